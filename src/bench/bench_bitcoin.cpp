@@ -4,9 +4,15 @@
 
 #include "bench.h"
 
+#include "chainparams.h"
 #include "key.h"
 #include "main.h"
+#include "random.h"
 #include "util.h"
+#include "utiltime.h"
+#include "test/testutil.h"
+
+#include <boost/filesystem.hpp>
 
 int
 main(int argc, char** argv)
@@ -15,7 +21,15 @@ main(int argc, char** argv)
     SetupEnvironment();
     fPrintToDebugLog = false; // don't want to write to debug.log file
 
+    // Databases created by the benchmarks live in a scratch data directory
+    SelectParams(CBaseChainParams::REGTEST);
+    boost::filesystem::path pathTemp = GetTempPath() / strprintf("bench_bitcoin_%lu_%i", (unsigned long)GetTime(), (int)(GetRand(100000)));
+    boost::filesystem::create_directories(pathTemp);
+    mapArgs["-datadir"] = pathTemp.string();
+
     benchmark::BenchRunner::RunAll();
 
+    boost::filesystem::remove_all(pathTemp);
+
     ECC_Stop();
 }
@@ -0,0 +1,69 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+#include "checkqueue.h"
+#include "hash.h"
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+namespace {
+
+/** Stand-in for a CScriptCheck: a few microseconds of hashing */
+struct HashCheck
+{
+    uint256 hash;
+
+    bool operator()()
+    {
+        for (int i = 0; i < 50; i++)
+            hash = Hash(hash.begin(), hash.end());
+        return true;
+    }
+
+    void swap(HashCheck& check)
+    {
+        std::swap(hash, check.hash);
+    }
+};
+
+/**
+ * Push blocks' worth of checks (in transaction-sized batches, as
+ * ConnectBlock does) through a queue with nThreads - 1 workers.
+ */
+void CheckQueueThroughput(benchmark::State& state, int nThreads)
+{
+    // Same batch size as the script check queue in main.cpp
+    CCheckQueue<HashCheck> queue(128);
+    boost::thread_group threadGroup;
+    for (int i = 1; i < nThreads; i++)
+        threadGroup.create_thread(boost::bind(&CCheckQueue<HashCheck>::Thread, &queue));
+
+    while (state.KeepRunning()) {
+        CCheckQueueControl<HashCheck> control(&queue);
+        for (int nTx = 0; nTx < 200; nTx++) {
+            std::vector<HashCheck> vChecks(2);
+            control.Add(vChecks);
+        }
+        control.Wait();
+    }
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+}
+
+}
+
+static void CheckQueue1Thread(benchmark::State& state) { CheckQueueThroughput(state, 1); }
+static void CheckQueue2Threads(benchmark::State& state) { CheckQueueThroughput(state, 2); }
+static void CheckQueue4Threads(benchmark::State& state) { CheckQueueThroughput(state, 4); }
+static void CheckQueue8Threads(benchmark::State& state) { CheckQueueThroughput(state, 8); }
+static void CheckQueue16Threads(benchmark::State& state) { CheckQueueThroughput(state, 16); }
+
+BENCHMARK(CheckQueue1Thread);
+BENCHMARK(CheckQueue2Threads);
+BENCHMARK(CheckQueue4Threads);
+BENCHMARK(CheckQueue8Threads);
+BENCHMARK(CheckQueue16Threads);
@@ -0,0 +1,109 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include <iostream>
+
+#include "bench.h"
+#include "clientversion.h"
+#include "coins.h"
+#include "random.h"
+#include "txdb.h"
+
+namespace {
+
+static const unsigned int nTransactions = 20000;
+static const unsigned int nOutputsPerTx = 20;
+
+/** Fill db with nTransactions transactions of nOutputsPerTx unspent outputs */
+void PopulateCoinsDB(CCoinsViewDB &db, std::vector<uint256> &txids)
+{
+    CCoinsViewCache cache(&db);
+    for (unsigned int i = 0; i < nTransactions; i++) {
+        CMutableTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+        tx.vout.resize(nOutputsPerTx);
+        for (unsigned int j = 0; j < nOutputsPerTx; j++) {
+            tx.vout[j].nValue = 1000 + j;
+            tx.vout[j].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << ToByteVector(GetRandHash()) << OP_EQUALVERIFY << OP_CHECKSIG;
+        }
+        txids.push_back(tx.GetHash());
+        *cache.ModifyNewCoins(txids.back(), false) = CCoins(tx, 1);
+    }
+    cache.Flush();
+}
+
+}
+
+// Spend (or restore) one output of each of 100 transactions per flush, the way
+// blocks touch a few outputs of many earlier transactions.
+static void CoinsDBFlush(benchmark::State& state)
+{
+    CCoinsViewDB db(8 << 20, false, true);
+    std::vector<uint256> txids;
+    PopulateCoinsDB(db, txids);
+
+    uint64_t nFlushes = 0, nBytes = 0, nLegacyBytes = 0;
+    uint32_t count = 0;
+    while (state.KeepRunning()) {
+        CCoinsViewCache cache(&db);
+        for (int i = 0; i < 100; i++, count++) {
+            const uint256 &txid = txids[count % nTransactions];
+            unsigned int nPos = (count / nTransactions) % nOutputsPerTx;
+            CCoinsModifier coins = cache.ModifyCoins(txid);
+            if (coins->IsAvailable(nPos)) {
+                coins->Spend(nPos);
+            } else {
+                coins->vout.resize(std::max((unsigned int)coins->vout.size(), nPos + 1));
+                coins->vout[nPos].nValue = 1000 + nPos;
+                coins->vout[nPos].scriptPubKey = CScript() << OP_TRUE;
+            }
+            // The per-transaction format rewrote the whole record; see
+            // CDBBatch for how LevelDB sizes writes and erases.
+            if (coins->IsPruned()) {
+                nLegacyBytes += 2 + 33;
+            } else {
+                size_t nSize = ::GetSerializeSize(*coins, SER_DISK, CLIENT_VERSION);
+                nLegacyBytes += 3 + 33 + (nSize > 127) + nSize;
+            }
+        }
+        cache.Flush();
+        nFlushes++;
+        nBytes += db.GetLastBatchSize();
+    }
+    std::cout << "CoinsDBFlush-bytes-per-output-format,1," << nBytes / nFlushes << "," << nBytes / nFlushes << "," << nBytes / nFlushes << "\n";
+    std::cout << "CoinsDBFlush-bytes-per-transaction-format,1," << nLegacyBytes / nFlushes << "," << nLegacyBytes / nFlushes << "," << nLegacyBytes / nFlushes << "\n";
+}
+
+static void CoinsDBLookupHit(benchmark::State& state)
+{
+    CCoinsViewDB db(8 << 20, false, true);
+    std::vector<uint256> txids;
+    PopulateCoinsDB(db, txids);
+
+    uint32_t count = 0;
+    CCoins coins;
+    while (state.KeepRunning()) {
+        db.GetCoins(txids[count++ % nTransactions], coins);
+    }
+}
+
+// Most lookups during block validation (BIP30 checks, mempool acceptance)
+// are for transactions that are not in the database.
+static void CoinsDBLookupMiss(benchmark::State& state)
+{
+    CCoinsViewDB db(8 << 20, false, true);
+    std::vector<uint256> txids;
+    PopulateCoinsDB(db, txids);
+
+    uint256 txid = GetRandHash();
+    while (state.KeepRunning()) {
+        *(uint32_t*)txid.begin() += 1;
+        db.HaveCoins(txid);
+    }
+}
+
+BENCHMARK(CoinsDBFlush);
+BENCHMARK(CoinsDBLookupHit);
+BENCHMARK(CoinsDBLookupMiss);
@@ -0,0 +1,70 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "key.h"
+#include "pubkey.h"
+#include "random.h"
+
+#include <cassert>
+#include <vector>
+
+namespace {
+
+/** A compressed key and a signature with it, as most inputs spend */
+struct SignedHash
+{
+    ECCVerifyHandle handle;
+    CPubKey pubkey;
+    uint256 hash;
+    std::vector<unsigned char> vchSig;
+
+    SignedHash()
+    {
+        CKey key;
+        key.MakeNewKey(true);
+        pubkey = key.GetPubKey();
+        hash = GetRandHash();
+        key.Sign(hash, vchSig);
+    }
+};
+
+}
+
+static void ECDSAVerify(benchmark::State& state)
+{
+    SignedHash signedHash;
+    bool fOk = true;
+    while (state.KeepRunning()) {
+        fOk &= signedHash.pubkey.Verify(signedHash.hash, signedHash.vchSig);
+    }
+    assert(fOk);
+}
+
+static void ECDSAVerifyParsed(benchmark::State& state)
+{
+    SignedHash signedHash;
+    CParsedPubKey parsed;
+    bool fOk = signedHash.pubkey.Parse(parsed);
+    while (state.KeepRunning()) {
+        fOk &= CPubKey::VerifyParsed(parsed, signedHash.hash, signedHash.vchSig);
+    }
+    assert(fOk);
+}
+
+static void ECDSAPubKeyParse(benchmark::State& state)
+{
+    SignedHash signedHash;
+    CParsedPubKey parsed;
+    bool fOk = true;
+    while (state.KeepRunning()) {
+        fOk &= signedHash.pubkey.Parse(parsed);
+    }
+    assert(fOk);
+}
+
+BENCHMARK(ECDSAVerify);
+BENCHMARK(ECDSAVerifyParsed);
+BENCHMARK(ECDSAPubKeyParse);
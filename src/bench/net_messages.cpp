@@ -0,0 +1,145 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "bench.h"
+
+#include "chainparams.h"
+#include "crypto/common.h"
+#include "hash.h"
+#include "main.h"
+#include "net.h"
+#include "primitives/block.h"
+#include "protocol.h"
+#include "streams.h"
+#include "utiltime.h"
+#include "version.h"
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
+namespace {
+
+void AppendMessage(std::string& strWire, const char* pszCommand, const CDataStream& ssPayload)
+{
+    CMessageHeader hdr(Params().MessageStart(), pszCommand, ssPayload.size());
+    uint256 hash = Hash(ssPayload.begin(), ssPayload.end());
+    hdr.nChecksum = ReadLE32(hash.begin());
+    CDataStream ssHeader(SER_NETWORK, PROTOCOL_VERSION);
+    ssHeader << hdr;
+    strWire += ssHeader.str();
+    strWire += ssPayload.str();
+}
+
+/**
+ * The bytes an inbound peer sends us: the handshake followed by a steady
+ * mix of pings, small addr relays, getheaders and feefilters, shaped after
+ * a capture of a listening node's traffic. Messages that need a chainstate
+ * (inv, tx, block) are left out, as the benchmark runs without one.
+ */
+std::string BuildMessageStream(int nRounds)
+{
+    std::string strWire;
+
+    // Addresses in the version message are serialized without their time
+    CDataStream ssVersion(SER_NETWORK, INIT_PROTO_VERSION);
+    CAddress addrYou(CService("127.0.0.1", 8333), NODE_NONE);
+    CAddress addrMe(CService("127.0.0.1", 18444), NODE_NETWORK);
+    ssVersion << PROTOCOL_VERSION << (uint64_t)NODE_NETWORK << GetTime() << addrYou << addrMe
+              << (uint64_t)0x1234 << std::string("/bench:0.1/") << 0 << true;
+    AppendMessage(strWire, NetMsgType::VERSION, ssVersion);
+
+    CDataStream ssEmpty(SER_NETWORK, PROTOCOL_VERSION);
+    AppendMessage(strWire, NetMsgType::VERACK, ssEmpty);
+    AppendMessage(strWire, NetMsgType::SENDHEADERS, ssEmpty);
+
+    std::vector<CAddress> vAddr;
+    for (int i = 0; i < 10; i++) {
+        CAddress addr(CService(strprintf("1.2.%d.%d", i, i + 1), 8333), NODE_NETWORK);
+        addr.nTime = GetTime();
+        vAddr.push_back(addr);
+    }
+    CBlockLocator locator;
+    for (int nRound = 0; nRound < nRounds; nRound++) {
+        CDataStream ssPing(SER_NETWORK, PROTOCOL_VERSION);
+        ssPing << (uint64_t)nRound;
+        AppendMessage(strWire, NetMsgType::PING, ssPing);
+
+        CDataStream ssAddr(SER_NETWORK, PROTOCOL_VERSION);
+        ssAddr << vAddr;
+        AppendMessage(strWire, NetMsgType::ADDR, ssAddr);
+
+        CDataStream ssGetHeaders(SER_NETWORK, PROTOCOL_VERSION);
+        ssGetHeaders << locator << uint256();
+        AppendMessage(strWire, NetMsgType::GETHEADERS, ssGetHeaders);
+
+        CDataStream ssFeeFilter(SER_NETWORK, PROTOCOL_VERSION);
+        ssFeeFilter << (CAmount)(1000 + nRound);
+        AppendMessage(strWire, NetMsgType::FEEFILTER, ssFeeFilter);
+    }
+    return strWire;
+}
+
+/** Drain every message a peer has received, as ThreadMessageHandler does */
+void ProcessPeers(const std::vector<CNode*>& vNodes, int nThread, int nThreads)
+{
+    for (size_t i = nThread; i < vNodes.size(); i += nThreads) {
+        CNode* pnode = vNodes[i];
+        LOCK(pnode->cs_vRecvMsg);
+        while (!pnode->fDisconnect && !pnode->vRecvMsg.empty()) {
+            GetNodeSignals().ProcessMessages(pnode);
+            // Throw the replies away, keeping the placeholder at the head
+            LOCK(pnode->cs_vSend);
+            pnode->vSendMsg.resize(1);
+            pnode->nSendSize = 0;
+        }
+    }
+}
+
+/**
+ * Replay the stream of 8 peers through nThreads message handlers, each
+ * owning a fixed subset of the peers. An iteration handles 8 * 1003 messages.
+ */
+void ReplayMessages(benchmark::State& state, int nThreads)
+{
+    static const int nPeers = 8;
+    const std::string strWire = BuildMessageStream(250);
+    RegisterNodeSignals(GetNodeSignals());
+
+    while (state.KeepRunning()) {
+        std::vector<CNode*> vNodes;
+        for (int i = 0; i < nPeers; i++) {
+            CNode* pnode = new CNode(INVALID_SOCKET, CAddress(CService(strprintf("10.0.0.%d", i + 1), 8333), NODE_NONE), "", true);
+            // Replies queue up behind this placeholder instead of being
+            // written to the (absent) socket.
+            pnode->vSendMsg.push_back(CSerializeData(1));
+            LOCK(pnode->cs_vRecvMsg);
+            for (size_t nPos = 0; nPos < strWire.size(); nPos += 0x10000)
+                pnode->ReceiveMsgBytes(&strWire[nPos], std::min<size_t>(0x10000, strWire.size() - nPos));
+            vNodes.push_back(pnode);
+        }
+
+        boost::thread_group threadGroup;
+        for (int i = 1; i < nThreads; i++)
+            threadGroup.create_thread(boost::bind(&ProcessPeers, boost::cref(vNodes), i, nThreads));
+        ProcessPeers(vNodes, 0, nThreads);
+        threadGroup.join_all();
+
+        BOOST_FOREACH(CNode* pnode, vNodes) {
+            assert(!pnode->fDisconnect);
+            delete pnode;
+        }
+    }
+
+    UnregisterNodeSignals(GetNodeSignals());
+}
+
+}
+
+static void MessageReplay1Thread(benchmark::State& state) { ReplayMessages(state, 1); }
+static void MessageReplay2Threads(benchmark::State& state) { ReplayMessages(state, 2); }
+static void MessageReplay4Threads(benchmark::State& state) { ReplayMessages(state, 4); }
+
+BENCHMARK(MessageReplay1Thread);
+BENCHMARK(MessageReplay2Threads);
+BENCHMARK(MessageReplay4Threads);
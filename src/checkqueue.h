@@ -6,9 +6,12 @@
 #define BITCOIN_CHECKQUEUE_H
 
 #include <algorithm>
+#include <atomic>
+#include <deque>
 #include <vector>
 
 #include <boost/foreach.hpp>
+#include <boost/scoped_array.hpp>
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/mutex.hpp>
@@ -25,136 +28,188 @@ class CCheckQueueControl;
   * onto the queue, where they are processed by N-1 worker threads. When
   * the master is done adding work, it temporarily joins the worker pool
   * as an N'th worker, until all jobs are done.
+  *
+  * Every worker has its own deque of checks, and the master spreads each
+  * batch it adds over all of them. A worker takes checks from its own deque
+  * and, once that runs dry, steals half of another worker's remaining
+  * checks. The deques have a lock each, which is only contended while
+  * stealing; the counters shared by all workers are atomics. Workers only
+  * sleep (on a condition variable) when no checks are queued anywhere.
   */
 template <typename T>
 class CCheckQueue
 {
 private:
-    //! Mutex to protect the inner state
-    boost::mutex mutex;
-
-    //! Worker threads block on this when out of work
-    boost::condition_variable condWorker;
-
-    //! Master thread blocks on this when out of work
-    boost::condition_variable condMaster;
+    struct WorkerQueue
+    {
+        boost::mutex mutex;
+        std::deque<T> checks;
+    };
 
-    //! The queue of elements to be processed.
-    //! As the order of booleans doesn't matter, it is used as a LIFO (stack)
-    std::vector<T> queue;
+    //! The per-worker deques; the master uses the first one
+    boost::scoped_array<WorkerQueue> queues;
 
-    //! The number of workers (including the master) that are idle.
-    int nIdle;
+    //! The number of deques
+    const unsigned int nQueues;
 
-    //! The total number of workers (including the master).
-    int nTotal;
+    //! The number of worker threads that have started, excluding the master
+    std::atomic<unsigned int> nWorkers;
 
-    //! The temporary evaluation result.
-    bool fAllOk;
+    //! Checks added but not taken out of a deque yet (briefly negative while Add runs)
+    std::atomic<int> nQueued;
 
     /**
      * Number of verifications that haven't completed yet.
      * This includes elements that are no longer queued, but still in the
      * worker's own batches.
      */
-    unsigned int nTodo;
+    std::atomic<unsigned int> nTodo;
+
+    //! The temporary evaluation result.
+    std::atomic<bool> fAllOk;
 
     //! Whether we're shutting down.
-    bool fQuit;
+    std::atomic<bool> fQuit;
 
     //! The maximum number of elements to be processed in one batch
     unsigned int nBatchSize;
 
+    //! Protects sleeping and waking up, nothing else
+    boost::mutex mutexSleep;
+
+    //! Worker threads block on this when out of work
+    boost::condition_variable condWorker;
+
+    //! Master thread blocks on this when out of work
+    boost::condition_variable condMaster;
+
+    //! The number of workers (excluding the master) that are sleeping, guarded by mutexSleep
+    int nIdle;
+
+    /**
+     * Move up to nBatchSize checks from the back of our own deque, or
+     * failing that, half of another one's from its front, into vChecks.
+     */
+    void Take(unsigned int nSlot, std::vector<T>& vChecks)
+    {
+        unsigned int nActive = std::min(nWorkers.load() + 1, nQueues);
+        for (unsigned int n = 0; n < nActive && vChecks.empty(); n++) {
+            WorkerQueue& queue = queues[(nSlot + n) % nActive];
+            boost::unique_lock<boost::mutex> lock(queue.mutex);
+            if (queue.checks.empty())
+                continue;
+            // Take from the back of our own deque, and from the front of
+            // someone else's, so owner and thief rarely want the same checks.
+            // Leave some behind either way, for other thieves.
+            size_t nNow = std::max<size_t>(1, std::min<size_t>(nBatchSize, queue.checks.size() / 2));
+            vChecks.resize(nNow);
+            for (size_t i = 0; i < nNow; i++) {
+                if (n == 0) {
+                    vChecks[i].swap(queue.checks.back());
+                    queue.checks.pop_back();
+                } else {
+                    vChecks[i].swap(queue.checks.front());
+                    queue.checks.pop_front();
+                }
+            }
+            nQueued -= vChecks.size();
+        }
+    }
+
     /** Internal function that does bulk of the verification work. */
-    bool Loop(bool fMaster = false)
+    bool Loop(unsigned int nSlot, bool fMaster = false)
     {
-        boost::condition_variable& cond = fMaster ? condMaster : condWorker;
         std::vector<T> vChecks;
         vChecks.reserve(nBatchSize);
-        unsigned int nNow = 0;
-        bool fOk = true;
         do {
-            {
-                boost::unique_lock<boost::mutex> lock(mutex);
-                // first do the clean-up of the previous loop run (allowing us to do it in the same critsect)
-                if (nNow) {
-                    fAllOk &= fOk;
-                    nTodo -= nNow;
-                    if (nTodo == 0 && !fMaster)
-                        // We processed the last element; inform the master it can exit and return the result
-                        condMaster.notify_one();
-                } else {
-                    // first iteration
-                    nTotal++;
-                }
-                // logically, the do loop starts here
-                while (queue.empty()) {
-                    if ((fMaster || fQuit) && nTodo == 0) {
-                        nTotal--;
+            Take(nSlot, vChecks);
+            if (vChecks.empty()) {
+                boost::unique_lock<boost::mutex> lock(mutexSleep);
+                if (fMaster) {
+                    // Wait for the workers to finish the checks they took
+                    while (nQueued <= 0 && nTodo != 0)
+                        condMaster.wait(lock);
+                    if (nTodo == 0) {
                         bool fRet = fAllOk;
                         // reset the status for new work later
-                        if (fMaster)
-                            fAllOk = true;
-                        // return the current status
+                        fAllOk = true;
                         return fRet;
                     }
+                } else {
+                    if (fQuit)
+                        return fAllOk;
                     nIdle++;
-                    cond.wait(lock); // wait
+                    while (nQueued <= 0 && !fQuit)
+                        condWorker.wait(lock);
                     nIdle--;
                 }
-                // Decide how many work units to process now.
-                // * Do not try to do everything at once, but aim for increasingly smaller batches so
-                //   all workers finish approximately simultaneously.
-                // * Try to account for idle jobs which will instantly start helping.
-                // * Don't do batches smaller than 1 (duh), or larger than nBatchSize.
-                nNow = std::max(1U, std::min(nBatchSize, (unsigned int)queue.size() / (nTotal + nIdle + 1)));
-                vChecks.resize(nNow);
-                for (unsigned int i = 0; i < nNow; i++) {
-                    // We want the lock on the mutex to be as short as possible, so swap jobs from the global
-                    // queue to the local batch vector instead of copying.
-                    vChecks[i].swap(queue.back());
-                    queue.pop_back();
-                }
-                // Check whether we need to do work at all
-                fOk = fAllOk;
+                continue;
             }
-            // execute work
+            // execute work; once a check has failed, the rest only needs to be counted
+            bool fOk = fAllOk;
             BOOST_FOREACH (T& check, vChecks)
                 if (fOk)
                     fOk = check();
+            if (!fOk)
+                fAllOk = false;
+            unsigned int nDone = vChecks.size();
             vChecks.clear();
+            if (nTodo.fetch_sub(nDone) == nDone && !fMaster) {
+                // We processed the last element; inform the master it can exit and return the result
+                boost::unique_lock<boost::mutex> lock(mutexSleep);
+                condMaster.notify_one();
+            }
         } while (true);
     }
 
 public:
-    //! Create a new check queue
-    CCheckQueue(unsigned int nBatchSizeIn) : nIdle(0), nTotal(0), fAllOk(true), nTodo(0), fQuit(false), nBatchSize(nBatchSizeIn) {}
+    //! Create a new check queue, with a deque for each of up to nQueuesIn - 1 workers plus the master
+    CCheckQueue(unsigned int nBatchSizeIn, unsigned int nQueuesIn = 64) :
+        queues(new WorkerQueue[nQueuesIn]), nQueues(nQueuesIn), nWorkers(0), nQueued(0), nTodo(0),
+        fAllOk(true), fQuit(false), nBatchSize(nBatchSizeIn), nIdle(0) {}
 
     //! Worker thread
     void Thread()
     {
-        Loop();
+        unsigned int nWorker = nWorkers++;
+        // Workers beyond the number of deques share one
+        Loop(1 + nWorker % (nQueues - 1));
     }
 
     //! Wait until execution finishes, and return whether all evaluations were successful.
     bool Wait()
     {
-        return Loop(true);
+        return Loop(0, true);
     }
 
     //! Add a batch of checks to the queue
     void Add(std::vector<T>& vChecks)
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        BOOST_FOREACH (T& check, vChecks) {
-            queue.push_back(T());
-            check.swap(queue.back());
-        }
+        if (vChecks.empty())
+            return;
         nTodo += vChecks.size();
-        if (vChecks.size() == 1)
-            condWorker.notify_one();
-        else if (vChecks.size() > 1)
-            condWorker.notify_all();
+        // Spread the checks over the deques in contiguous slices
+        unsigned int nActive = std::min(nWorkers.load() + 1, nQueues);
+        size_t nPos = 0;
+        for (unsigned int n = 0; n < nActive; n++) {
+            size_t nEnd = vChecks.size() * (n + 1) / nActive;
+            if (nEnd == nPos)
+                continue;
+            WorkerQueue& queue = queues[n];
+            boost::unique_lock<boost::mutex> lock(queue.mutex);
+            for (; nPos < nEnd; nPos++) {
+                queue.checks.push_back(T());
+                vChecks[nPos].swap(queue.checks.back());
+            }
+        }
+        nQueued += vChecks.size();
+        boost::unique_lock<boost::mutex> lock(mutexSleep);
+        if (nIdle > 0) {
+            if (vChecks.size() == 1)
+                condWorker.notify_one();
+            else
+                condWorker.notify_all();
+        }
     }
 
     ~CCheckQueue()
@@ -163,12 +218,10 @@ public:
 
     bool IsIdle()
     {
-        boost::unique_lock<boost::mutex> lock(mutex);
-        return (nTotal == nIdle && nTodo == 0 && fAllOk == true);
+        return nTodo == 0 && nQueued == 0 && fAllOk;
     }
 
 };
-
 /** 
  * RAII-style controller object for a CCheckQueue that guarantees the passed
  * queue is finished before continuing.
@@ -7,8 +7,12 @@
 #include "memusage.h"
 #include "random.h"
 
+#include <algorithm>
 #include <assert.h>
 
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+
 /**
  * calculate number of bytes for the bitmask, and its number of non-zero bytes
  * each bit in the bitmask represents the availability of one output, but the
@@ -41,6 +45,43 @@ bool CCoins::Spend(uint32_t nPos)
     return true;
 }
 
+void CCoinsBaseMask::Set(const CCoins &coins)
+{
+    SetUnknown();
+    nBits = 0;
+    if (coins.vout.size() > INLINE_OUTPUTS) {
+        pvBits = new std::vector<uint64_t>((coins.vout.size() + 63) / 64, 0);
+        for (unsigned int i = 0; i < coins.vout.size(); i++)
+            if (!coins.vout[i].IsNull())
+                (*pvBits)[i / 64] |= (uint64_t)1 << (i % 64);
+    } else {
+        for (unsigned int i = 0; i < coins.vout.size(); i++)
+            if (!coins.vout[i].IsNull())
+                nBits |= (uint64_t)1 << i;
+    }
+}
+
+bool CCoinsBaseMask::IsEmpty() const
+{
+    if (pvBits) {
+        BOOST_FOREACH(uint64_t nWord, *pvBits)
+            if (nWord)
+                return false;
+        return true;
+    }
+    return nBits == 0;
+}
+
+unsigned int CCoinsBaseMask::GetBound() const
+{
+    if (pvBits)
+        return pvBits->size() * 64;
+    unsigned int nBound = 0;
+    for (uint64_t n = nBits & ~UNKNOWN; n; n >>= 1)
+        nBound++;
+    return nBound;
+}
+
 bool CCoinsView::GetCoins(const uint256 &txid, CCoins &coins) const { return false; }
 bool CCoinsView::HaveCoins(const uint256 &txid) const { return false; }
 uint256 CCoinsView::GetBestBlock() const { return uint256(); }
@@ -83,7 +124,8 @@ CCoinsMap::const_iterator CCoinsViewCache::FetchCoins(const uint256 &txid) const
         // version as fresh.
         ret->second.flags = CCoinsCacheEntry::FRESH;
     }
-    cachedCoinsUsage += ret->second.coins.DynamicMemoryUsage();
+    ret->second.baseAvail.Set(ret->second.coins);
+    cachedCoinsUsage += ret->second.coins.DynamicMemoryUsage() + ret->second.baseAvail.DynamicMemoryUsage();
     return ret;
 }
 
@@ -109,6 +151,8 @@ CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256 &txid) {
             // The parent view only has a pruned entry for this; mark it as fresh.
             ret.first->second.flags = CCoinsCacheEntry::FRESH;
         }
+        ret.first->second.baseAvail.Set(ret.first->second.coins);
+        cachedCoinsUsage += ret.first->second.baseAvail.DynamicMemoryUsage();
     } else {
         cachedCoinUsage = ret.first->second.coins.DynamicMemoryUsage();
     }
@@ -125,6 +169,16 @@ CCoinsModifier CCoinsViewCache::ModifyNewCoins(const uint256 &txid, bool coinbas
     assert(!hasModifier);
     std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry()));
     ret.first->second.coins.Clear();
+    if (ret.second) {
+        // Nobody looked this txid up, so the parent has no unspent outputs
+        // for it (see the comment in coins.h).
+        ret.first->second.baseAvail.Set(ret.first->second.coins);
+    } else if (ret.first->second.MayHaveBaseCoins()) {
+        // We are replacing coins that the parent may still hold, possibly with
+        // different metadata, so it has to rewrite the transaction wholesale.
+        cachedCoinsUsage -= ret.first->second.baseAvail.DynamicMemoryUsage();
+        ret.first->second.baseAvail.SetUnknown();
+    }
     if (!coinbase) {
         ret.first->second.flags = CCoinsCacheEntry::FRESH;
     }
@@ -155,6 +209,58 @@ bool CCoinsViewCache::HaveCoinsInCache(const uint256 &txid) const {
     return it != cacheCoins.end();
 }
 
+namespace {
+
+/** Read every nStep'th of txids from base, starting at nBegin */
+void PrefetchCoinsWorker(const CCoinsView *base, const std::vector<uint256> *txids, std::vector<CCoins> *vCoins, std::vector<char> *vFound, size_t nBegin, size_t nStep)
+{
+    for (size_t i = nBegin; i < txids->size(); i += nStep) {
+        (*vFound)[i] = base->GetCoins((*txids)[i], (*vCoins)[i]);
+    }
+}
+
+}
+
+size_t CCoinsViewCache::Prefetch(const std::vector<uint256> &txids, int nThreads) {
+    std::vector<uint256> vMissing;
+    vMissing.reserve(txids.size());
+    BOOST_FOREACH(const uint256 &txid, txids) {
+        if (!cacheCoins.count(txid))
+            vMissing.push_back(txid);
+    }
+    std::sort(vMissing.begin(), vMissing.end());
+    vMissing.erase(std::unique(vMissing.begin(), vMissing.end()), vMissing.end());
+    if (vMissing.empty())
+        return 0;
+
+    std::vector<CCoins> vCoins(vMissing.size());
+    std::vector<char> vFound(vMissing.size(), false);
+    size_t nWorkers = std::min((size_t)std::max(nThreads, 1), vMissing.size());
+    boost::thread_group threadGroup;
+    for (size_t n = 1; n < nWorkers; n++)
+        threadGroup.create_thread(boost::bind(&PrefetchCoinsWorker, base, &vMissing, &vCoins, &vFound, n, nWorkers));
+    PrefetchCoinsWorker(base, &vMissing, &vCoins, &vFound, 0, nWorkers);
+    threadGroup.join_all();
+
+    // Insert what was found the way FetchCoins does.
+    size_t nLoaded = 0;
+    for (size_t i = 0; i < vMissing.size(); i++) {
+        if (!vFound[i])
+            continue;
+        CCoinsCacheEntry &entry = cacheCoins[vMissing[i]];
+        entry.coins.swap(vCoins[i]);
+        if (entry.coins.IsPruned()) {
+            // The parent only has an empty entry for this txid; we can consider our
+            // version as fresh.
+            entry.flags = CCoinsCacheEntry::FRESH;
+        }
+        entry.baseAvail.Set(entry.coins);
+        cachedCoinsUsage += entry.coins.DynamicMemoryUsage() + entry.baseAvail.DynamicMemoryUsage();
+        nLoaded++;
+    }
+    return nLoaded;
+}
+
 uint256 CCoinsViewCache::GetBestBlock() const {
     if (hashBlock.IsNull())
         hashBlock = base->GetBestBlock();
@@ -178,7 +284,8 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn
                     // and move the data up and mark it as dirty
                     CCoinsCacheEntry& entry = cacheCoins[it->first];
                     entry.coins.swap(it->second.coins);
-                    cachedCoinsUsage += entry.coins.DynamicMemoryUsage();
+                    entry.baseAvail.swap(it->second.baseAvail);
+                    cachedCoinsUsage += entry.coins.DynamicMemoryUsage() + entry.baseAvail.DynamicMemoryUsage();
                     entry.flags = CCoinsCacheEntry::DIRTY;
                     // We can mark it FRESH in the parent if it was FRESH in the child
                     // Otherwise it might have just been flushed from the parent's cache
@@ -192,11 +299,18 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn
                     // The grandparent does not have an entry, and the child is
                     // modified and being pruned. This means we can just delete
                     // it from the parent.
-                    cachedCoinsUsage -= itUs->second.coins.DynamicMemoryUsage();
+                    cachedCoinsUsage -= itUs->second.coins.DynamicMemoryUsage() + itUs->second.baseAvail.DynamicMemoryUsage();
                     cacheCoins.erase(itUs);
                 } else {
                     // A normal modification.
                     cachedCoinsUsage -= itUs->second.coins.DynamicMemoryUsage();
+                    bool fChildSawNoCoins = !it->second.MayHaveBaseCoins();
+                    if (!it->second.HasBaseAvail() || (fChildSawNoCoins && itUs->second.MayHaveBaseCoins())) {
+                        // The child rebuilt the entry over coins that our parent
+                        // may still hold, so we can no longer tell what changed.
+                        cachedCoinsUsage -= itUs->second.baseAvail.DynamicMemoryUsage();
+                        itUs->second.baseAvail.SetUnknown();
+                    }
                     itUs->second.coins.swap(it->second.coins);
                     cachedCoinsUsage += itUs->second.coins.DynamicMemoryUsage();
                     itUs->second.flags |= CCoinsCacheEntry::DIRTY;
@@ -221,7 +335,7 @@ void CCoinsViewCache::Uncache(const uint256& hash)
 {
     CCoinsMap::iterator it = cacheCoins.find(hash);
     if (it != cacheCoins.end() && it->second.flags == 0) {
-        cachedCoinsUsage -= it->second.coins.DynamicMemoryUsage();
+        cachedCoinsUsage -= it->second.coins.DynamicMemoryUsage() + it->second.baseAvail.DynamicMemoryUsage();
         cacheCoins.erase(it);
     }
 }
@@ -294,6 +408,7 @@ CCoinsModifier::~CCoinsModifier()
     it->second.coins.Cleanup();
     cache.cachedCoinsUsage -= cachedCoinUsage; // Subtract the old usage
     if ((it->second.flags & CCoinsCacheEntry::FRESH) && it->second.coins.IsPruned()) {
+        cache.cachedCoinsUsage -= it->second.baseAvail.DynamicMemoryUsage();
         cache.cacheCoins.erase(it);
     } else {
         // If the coin still exists after the modification, add the new usage
@@ -284,10 +284,81 @@ public:
     }
 };
 
+/**
+ * Which outputs of a cache entry are unspent in the parent view. The coins
+ * database stores one record per output, so this lets it write and erase
+ * only the outputs that actually changed.
+ *
+ * Transactions with up to 63 outputs are tracked inline, larger ones in a
+ * heap-allocated bitmap, so the common case adds 16 bytes to an entry. The
+ * state is unknown when an entry replaced the parent's coins without
+ * looking at them; the database then rewrites the transaction wholesale.
+ */
+class CCoinsBaseMask
+{
+private:
+    //! Outputs 0..62; the top bit marks an unknown state
+    uint64_t nBits;
+    //! Bitmap of all outputs for transactions with more than 63 of them
+    std::vector<uint64_t> *pvBits;
+
+    static const uint64_t UNKNOWN = (uint64_t)1 << 63;
+    static const unsigned int INLINE_OUTPUTS = 63;
+
+public:
+    CCoinsBaseMask() : nBits(UNKNOWN), pvBits(NULL) {}
+    CCoinsBaseMask(const CCoinsBaseMask &other) : nBits(other.nBits), pvBits(other.pvBits ? new std::vector<uint64_t>(*other.pvBits) : NULL) {}
+    ~CCoinsBaseMask() { delete pvBits; }
+
+    CCoinsBaseMask& operator=(CCoinsBaseMask other) {
+        swap(other);
+        return *this;
+    }
+
+    void swap(CCoinsBaseMask &other) {
+        std::swap(nBits, other.nBits);
+        std::swap(pvBits, other.pvBits);
+    }
+
+    //! Record the unspent outputs of coins as the parent view's state
+    void Set(const CCoins &coins);
+
+    //! Forget the parent view's state
+    void SetUnknown() {
+        delete pvBits;
+        pvBits = NULL;
+        nBits = UNKNOWN;
+    }
+
+    bool IsKnown() const {
+        return pvBits != NULL || !(nBits & UNKNOWN);
+    }
+
+    //! Whether the parent view had no unspent outputs at all
+    bool IsEmpty() const;
+
+    //! Whether output nPos was unspent in the parent view
+    bool IsAvailable(unsigned int nPos) const {
+        if (pvBits)
+            return nPos / 64 < pvBits->size() && (((*pvBits)[nPos / 64] >> (nPos % 64)) & 1);
+        return nPos < INLINE_OUTPUTS && ((nBits >> nPos) & 1);
+    }
+
+    //! One past the highest output index that may have been unspent
+    unsigned int GetBound() const;
+
+    size_t DynamicMemoryUsage() const {
+        if (!pvBits)
+            return 0;
+        return memusage::MallocUsage(sizeof(std::vector<uint64_t>)) + memusage::DynamicUsage(*pvBits);
+    }
+};
+
 struct CCoinsCacheEntry
 {
     CCoins coins; // The actual cached data.
     unsigned char flags;
+    CCoinsBaseMask baseAvail; // Which outputs the parent view has unspent.
 
     enum Flags {
         DIRTY = (1 << 0), // This cache entry is potentially different from the version in the parent view.
@@ -295,6 +366,16 @@ struct CCoinsCacheEntry
     };
 
     CCoinsCacheEntry() : coins(), flags(0) {}
+
+    //! Whether we know which outputs the parent view has for this entry
+    bool HasBaseAvail() const {
+        return (flags & FRESH) || baseAvail.IsKnown();
+    }
+
+    //! Whether the parent view may have unspent outputs for this entry
+    bool MayHaveBaseCoins() const {
+        return !(flags & FRESH) && !(baseAvail.IsKnown() && baseAvail.IsEmpty());
+    }
 };
 
 typedef boost::unordered_map<uint256, CCoinsCacheEntry, SaltedTxidHasher> CCoinsMap;
@@ -421,6 +502,16 @@ public:
      */
     bool HaveCoinsInCache(const uint256 &txid) const;
 
+    /**
+     * Load the coins of the given txids that are not in this cache yet,
+     * reading them from the backing view on nThreads threads at once. This
+     * lets the backing database serve many lookups in parallel, rather than
+     * one cache miss at a time. The backing view must support concurrent
+     * GetCoins calls, as CCoinsViewDB does. Returns the number of entries
+     * loaded.
+     */
+    size_t Prefetch(const std::vector<uint256> &txids, int nThreads);
+
     /**
      * Return a pointer to CCoins in the cache, or NULL if not found. This is
      * more efficient than GetCoins. Modifications to other cache entries are
@@ -443,6 +534,11 @@ public:
      * in the event the duplicate coinbase was spent before a flush, the now pruned coins
      * would not properly overwrite the first coinbase of the pair. Simultaneous modifications
      * are not allowed.
+     *
+     * If the txid was not looked up in this cache before, the parent is assumed to have no
+     * unspent outputs for it, so only the new outputs get written out on flush. ConnectBlock
+     * looks up every txid it creates (BIP30) unless that is ruled out by BIP34, and it loads
+     * the two historical duplicate coinbases explicitly.
      */
     CCoinsModifier ModifyNewCoins(const uint256 &txid, bool coinbase);
 
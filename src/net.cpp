@@ -27,6 +27,10 @@
 #include <fcntl.h>
 #endif
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
 #ifdef USE_UPNP
 #include <miniupnpc/miniupnpc.h>
 #include <miniupnpc/miniwget.h>
@@ -45,6 +49,11 @@
 // We add a random period time (0 to 1 seconds) to feeler connections to prevent synchronization.
 #define FEELER_SLEEP_WINDOW 1
 
+// How long the socket handler waits for socket events before polling pnode->vSend again
+#define SOCKET_EVENTS_TIMEOUT_MILLISECONDS 50
+// The most events to take from epoll at once
+#define MAX_EPOLL_EVENTS 256
+
 #if !defined(HAVE_MSG_NOSIGNAL) && !defined(MSG_NOSIGNAL)
 #define MSG_NOSIGNAL 0
 #endif
@@ -93,6 +102,12 @@ uint64_t nLocalHostNonce = 0;
 static std::vector<ListenSocket> vhListenSocket;
 CAddrMan addrman;
 int nMaxConnections = DEFAULT_MAX_PEER_CONNECTIONS;
+int nMessageHandlerThreads = DEFAULT_MSGHAND_THREADS;
+#ifdef HAVE_SYS_EPOLL_H
+SocketEventsMode nSocketEventsMode = SOCKETEVENTS_EPOLL;
+#else
+SocketEventsMode nSocketEventsMode = SOCKETEVENTS_SELECT;
+#endif
 bool fAddressesInitialized = false;
 std::string strSubVersion;
 
@@ -110,7 +125,13 @@ NodeId nLastNodeId = 0;
 CCriticalSection cs_nLastNodeId;
 
 static CSemaphore *semOutbound = NULL;
-boost::condition_variable messageHandlerCondition;
+static boost::condition_variable messageHandlerCondition[MAX_MSGHAND_THREADS];
+
+/** The message handler thread that owns a peer */
+static int GetMessageHandlerThread(NodeId id)
+{
+    return id % nMessageHandlerThreads;
+}
 
 // Signals for message handling
 static CNodeSignals g_signals;
@@ -408,7 +429,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest, bool fCountFailure
     if (pszDest ? ConnectSocketByName(addrConnect, hSocket, pszDest, Params().GetDefaultPort(), nConnectTimeout, &proxyConnectionFailed) :
                   ConnectSocket(addrConnect, hSocket, nConnectTimeout, &proxyConnectionFailed))
     {
-        if (!IsSelectableSocket(hSocket)) {
+        if (nSocketEventsMode == SOCKETEVENTS_SELECT && !IsSelectableSocket(hSocket)) {
             LogPrintf("Cannot create connection: non-selectable socket created (fd >= FD_SETSIZE ?)\n");
             CloseSocket(hSocket);
             return NULL;
@@ -751,24 +772,47 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
         pch += handled;
         nBytes -= handled;
 
-        if (msg.complete()) {
-
-            //store received bytes per message command
-            //to prevent a memory DOS, only allow valid commands
-            mapMsgCmdSize::iterator i = mapRecvBytesPerMsgCmd.find(msg.hdr.pchCommand);
-            if (i == mapRecvBytesPerMsgCmd.end())
-                i = mapRecvBytesPerMsgCmd.find(NET_MESSAGE_COMMAND_OTHER);
-            assert(i != mapRecvBytesPerMsgCmd.end());
-            i->second += msg.hdr.nMessageSize + CMessageHeader::HEADER_SIZE;
-
-            msg.nTime = GetTimeMicros();
-            messageHandlerCondition.notify_one();
-        }
+        if (msg.complete())
+            MessageComplete(msg);
     }
 
     return true;
 }
 
+void CNode::MessageComplete(CNetMessage& msg)
+{
+    //store received bytes per message command
+    //to prevent a memory DOS, only allow valid commands
+    mapMsgCmdSize::iterator i = mapRecvBytesPerMsgCmd.find(msg.hdr.pchCommand);
+    if (i == mapRecvBytesPerMsgCmd.end())
+        i = mapRecvBytesPerMsgCmd.find(NET_MESSAGE_COMMAND_OTHER);
+    assert(i != mapRecvBytesPerMsgCmd.end());
+    i->second += msg.hdr.nMessageSize + CMessageHeader::HEADER_SIZE;
+
+    msg.nTime = GetTimeMicros();
+    messageHandlerCondition[GetMessageHandlerThread(id)].notify_one();
+}
+
+char* CNode::GetInPlaceRecvBuffer(unsigned int nBytes)
+{
+    if (vRecvMsg.empty() || !vRecvMsg.back().in_data || vRecvMsg.back().complete())
+        return NULL;
+    CNetMessage& msg = vRecvMsg.back();
+    // Small remainders go through the bounce buffer, which can also take
+    // the headers of the messages following them in the same recv().
+    if (msg.hdr.nMessageSize - msg.nDataPos < nBytes)
+        return NULL;
+    return msg.GetDataBuffer(nBytes);
+}
+
+void CNode::ReceivedMsgBytesInPlace(unsigned int nBytes)
+{
+    CNetMessage& msg = vRecvMsg.back();
+    msg.DataReceived(nBytes);
+    if (msg.complete())
+        MessageComplete(msg);
+}
+
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
@@ -805,15 +849,33 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
-    if (vRecv.size() < nDataPos + nCopy) {
+    memcpy(GetDataBuffer(nCopy), pch, nCopy);
+    DataReceived(nCopy);
+
+    return nCopy;
+}
+
+char* CNetMessage::GetDataBuffer(unsigned int nBytes)
+{
+    nBytes = std::min(nBytes, hdr.nMessageSize - nDataPos);
+
+    if (vRecv.size() < nDataPos + nBytes) {
         // Allocate up to 256 KiB ahead, but never more than the total message size.
-        vRecv.resize(std::min(hdr.nMessageSize, nDataPos + nCopy + 256 * 1024));
+        unsigned int nSize = std::min(hdr.nMessageSize, nDataPos + nBytes + 256 * 1024);
+        // Grow the allocation geometrically so large messages are not copied
+        // over and over, but cap it at the message size (resize() alone may
+        // double it past that).
+        vRecv.reserve(std::min(hdr.nMessageSize, std::max(nSize, 2 * (unsigned int)vRecv.size())));
+        vRecv.resize(nSize);
     }
 
-    memcpy(&vRecv[nDataPos], pch, nCopy);
-    nDataPos += nCopy;
+    return &vRecv[nDataPos];
+}
 
-    return nCopy;
+void CNetMessage::DataReceived(unsigned int nBytes)
+{
+    assert(nDataPos + nBytes <= vRecv.size());
+    nDataPos += nBytes;
 }
 
 
@@ -1043,7 +1105,7 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
         return;
     }
 
-    if (!IsSelectableSocket(hSocket))
+    if (nSocketEventsMode == SOCKETEVENTS_SELECT && !IsSelectableSocket(hSocket))
     {
         LogPrintf("connection from %s dropped: non-selectable socket\n", addr.ToString());
         CloseSocket(hSocket);
@@ -1088,11 +1150,289 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
     }
 }
 
+static CCriticalSection cs_socketHandlerStats;
+static CSocketHandlerStats socketHandlerStats = {0, 0, 0, 0};
+
+void GetSocketHandlerStats(CSocketHandlerStats& stats)
+{
+    LOCK(cs_socketHandlerStats);
+    stats = socketHandlerStats;
+}
+
+bool ParseSocketEventsMode(const std::string& strMode, SocketEventsMode& mode)
+{
+    if (strMode == "select") {
+        mode = SOCKETEVENTS_SELECT;
+        return true;
+    }
+#ifdef HAVE_SYS_EPOLL_H
+    if (strMode == "epoll") {
+        mode = SOCKETEVENTS_EPOLL;
+        return true;
+    }
+#endif
+    return false;
+}
+
+std::string GetSocketEventsModeName(SocketEventsMode mode)
+{
+    switch (mode) {
+    case SOCKETEVENTS_SELECT: return "select";
+    case SOCKETEVENTS_EPOLL: return "epoll";
+    }
+    return "";
+}
+
+/**
+ * Decide whether to send to or receive from pnode's socket.
+ * Implement the following logic:
+ * * If there is data to send, select() for sending data. As this only
+ *   happens when optimistic write failed, we choose to first drain the
+ *   write buffer in this case before receiving more. This avoids
+ *   needlessly queueing received data, if the remote peer is not themselves
+ *   receiving data. This means properly utilizing TCP flow control signalling.
+ * * Otherwise, if there is no (complete) message in the receive buffer,
+ *   or there is space left in the buffer, select() for receiving data.
+ * * (if neither of the above applies, there is certainly one message
+ *   in the receiver buffer ready to be processed).
+ * Together, that means that at least one of the following is always possible,
+ * so we don't deadlock:
+ * * We send some data.
+ * * We wait for data to be received (and disconnect after timeout).
+ * * We process a message in the buffer (message handler thread).
+ */
+static void GetWantedSocketEvents(CNode* pnode, bool& fWantSend, bool& fWantRecv)
+{
+    fWantSend = false;
+    fWantRecv = false;
+    {
+        TRY_LOCK(pnode->cs_vSend, lockSend);
+        if (lockSend && !pnode->vSendMsg.empty()) {
+            fWantSend = true;
+            return;
+        }
+    }
+    {
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (lockRecv && (
+            pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+            pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
+            fWantRecv = true;
+    }
+}
+
+/** Wait for socket events with select(), which only handles sockets below FD_SETSIZE. */
+static void SocketEventsSelect(std::set<SOCKET>& setRecv, std::set<SOCKET>& setSend, std::set<SOCKET>& setError, int64_t& nWaitMicros)
+{
+    struct timeval timeout;
+    timeout.tv_sec  = 0;
+    timeout.tv_usec = SOCKET_EVENTS_TIMEOUT_MILLISECONDS * 1000; // frequency to poll pnode->vSend
+
+    fd_set fdsetRecv;
+    fd_set fdsetSend;
+    fd_set fdsetError;
+    FD_ZERO(&fdsetRecv);
+    FD_ZERO(&fdsetSend);
+    FD_ZERO(&fdsetError);
+    SOCKET hSocketMax = 0;
+    bool have_fds = false;
+    std::vector<SOCKET> vSelected;
+
+    BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
+        FD_SET(hListenSocket.socket, &fdsetRecv);
+        hSocketMax = std::max(hSocketMax, hListenSocket.socket);
+        have_fds = true;
+        vSelected.push_back(hListenSocket.socket);
+    }
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            FD_SET(pnode->hSocket, &fdsetError);
+            hSocketMax = std::max(hSocketMax, pnode->hSocket);
+            have_fds = true;
+            vSelected.push_back(pnode->hSocket);
+
+            bool fWantSend, fWantRecv;
+            GetWantedSocketEvents(pnode, fWantSend, fWantRecv);
+            if (fWantSend)
+                FD_SET(pnode->hSocket, &fdsetSend);
+            else if (fWantRecv)
+                FD_SET(pnode->hSocket, &fdsetRecv);
+        }
+    }
+
+    int64_t nWaitStart = GetTimeMicros();
+    int nSelect = select(have_fds ? hSocketMax + 1 : 0,
+                         &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
+    nWaitMicros = GetTimeMicros() - nWaitStart;
+    boost::this_thread::interruption_point();
+
+    if (nSelect == SOCKET_ERROR)
+    {
+        if (have_fds)
+        {
+            int nErr = WSAGetLastError();
+            LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
+            setRecv.insert(vSelected.begin(), vSelected.end());
+        }
+        MilliSleep(timeout.tv_usec/1000);
+        return;
+    }
+
+    BOOST_FOREACH(SOCKET hSocket, vSelected) {
+        if (FD_ISSET(hSocket, &fdsetRecv))
+            setRecv.insert(hSocket);
+        if (FD_ISSET(hSocket, &fdsetSend))
+            setSend.insert(hSocket);
+        if (FD_ISSET(hSocket, &fdsetError))
+            setError.insert(hSocket);
+    }
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+/** An epoll instance with the listening sockets registered, closed when it goes out of scope */
+class CEpollHandle
+{
+public:
+    int h;
+
+    CEpollHandle() : h(-1) {}
+
+    ~CEpollHandle()
+    {
+        if (h != -1)
+            close(h);
+    }
+
+    bool Open()
+    {
+        h = epoll_create1(EPOLL_CLOEXEC);
+        if (h == -1)
+            return false;
+        // Listening sockets are level-triggered: we accept one connection per
+        // iteration, and the rest stay reported until they are accepted too.
+        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
+            struct epoll_event event;
+            event.events = EPOLLIN;
+            event.data.ptr = NULL;
+            if (epoll_ctl(h, EPOLL_CTL_ADD, hListenSocket.socket, &event) == SOCKET_ERROR)
+                return false;
+        }
+        return true;
+    }
+};
+
+/**
+ * Add pnode's socket to the sets it is ready for and the socket handler
+ * wants (see GetWantedSocketEvents).
+ */
+static void AddReadySocket(CNode* pnode, std::set<SOCKET>& setRecv, std::set<SOCKET>& setSend)
+{
+    bool fWantSend, fWantRecv;
+    GetWantedSocketEvents(pnode, fWantSend, fWantRecv);
+    if (fWantSend && pnode->fSocketWritable)
+        setSend.insert(pnode->hSocket);
+    else if (fWantRecv && pnode->fSocketReadable)
+        setRecv.insert(pnode->hSocket);
+}
+
+/**
+ * Wait for socket events with edge-triggered epoll, which has no limit on
+ * socket numbers and does not rescan every socket in the kernel. Each peer's
+ * socket is registered once; the kernel reports when it becomes readable or
+ * writable, which is remembered in CNode::fSocketReadable/fSocketWritable
+ * until a short recv() or send() shows the kernel buffer ran dry or full.
+ * Peers that are still ready from an earlier edge are serviced without
+ * blocking.
+ */
+static void SocketEventsEpoll(int hEpoll, std::set<SOCKET>& setRecv, std::set<SOCKET>& setSend, std::set<SOCKET>& setError, int64_t& nWaitMicros)
+{
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+        {
+            if (pnode->hSocket == INVALID_SOCKET)
+                continue;
+            if (!pnode->fSocketRegistered) {
+                // Hold cs_vSend, so a failing optimistic send cannot close the
+                // socket (and free its number for reuse) while we register it.
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (!lockSend || pnode->hSocket == INVALID_SOCKET)
+                    continue;
+                struct epoll_event event;
+                event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+                event.data.ptr = pnode;
+                if (epoll_ctl(hEpoll, EPOLL_CTL_ADD, pnode->hSocket, &event) == SOCKET_ERROR) {
+                    LogPrintf("epoll_ctl error for peer=%d: %s\n", pnode->id, NetworkErrorString(WSAGetLastError()));
+                    pnode->fDisconnect = true;
+                    continue;
+                }
+                // The kernel reports the socket's current state as the first edge
+                pnode->fSocketRegistered = true;
+                continue;
+            }
+            AddReadySocket(pnode, setRecv, setSend);
+        }
+    }
+
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    int nTimeout = setRecv.empty() && setSend.empty() ? SOCKET_EVENTS_TIMEOUT_MILLISECONDS : 0;
+    int64_t nWaitStart = GetTimeMicros();
+    int nEvents = epoll_wait(hEpoll, events, MAX_EPOLL_EVENTS, nTimeout);
+    nWaitMicros = GetTimeMicros() - nWaitStart;
+    boost::this_thread::interruption_point();
+
+    if (nEvents == SOCKET_ERROR)
+    {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEINTR) {
+            LogPrintf("socket epoll error %s\n", NetworkErrorString(nErr));
+            MilliSleep(nTimeout);
+        }
+        return;
+    }
+
+    // Nodes are only deleted by this thread, after their socket is closed
+    // (which unregisters it), so the pointers in the events are still valid.
+    for (int i = 0; i < nEvents; i++) {
+        CNode* pnode = (CNode*)events[i].data.ptr;
+        if (pnode == NULL) {
+            BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+                setRecv.insert(hListenSocket.socket);
+            continue;
+        }
+        if (pnode->hSocket == INVALID_SOCKET)
+            continue;
+        if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            pnode->fSocketReadable = true;
+        if (events[i].events & EPOLLOUT)
+            pnode->fSocketWritable = true;
+        if (events[i].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            setError.insert(pnode->hSocket);
+        AddReadySocket(pnode, setRecv, setSend);
+    }
+}
+#endif
+
 void ThreadSocketHandler()
 {
+#ifdef HAVE_SYS_EPOLL_H
+    CEpollHandle epoll;
+    if (nSocketEventsMode == SOCKETEVENTS_EPOLL && !epoll.Open()) {
+        LogPrintf("Creating epoll instance failed, falling back to select(): %s\n", NetworkErrorString(WSAGetLastError()));
+        nSocketEventsMode = SOCKETEVENTS_SELECT;
+    }
+#endif
+
     unsigned int nPrevNodeCount = 0;
     while (true)
     {
+        int64_t nIterationStart = GetTimeMicros();
+
         //
         // Disconnect nodes
         //
@@ -1159,91 +1499,21 @@ void ThreadSocketHandler()
         //
         // Find which sockets have data to receive
         //
-        struct timeval timeout;
-        timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
-
-        fd_set fdsetRecv;
-        fd_set fdsetSend;
-        fd_set fdsetError;
-        FD_ZERO(&fdsetRecv);
-        FD_ZERO(&fdsetSend);
-        FD_ZERO(&fdsetError);
-        SOCKET hSocketMax = 0;
-        bool have_fds = false;
-
-        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
-            FD_SET(hListenSocket.socket, &fdsetRecv);
-            hSocketMax = std::max(hSocketMax, hListenSocket.socket);
-            have_fds = true;
-        }
-
-        {
-            LOCK(cs_vNodes);
-            BOOST_FOREACH(CNode* pnode, vNodes)
-            {
-                if (pnode->hSocket == INVALID_SOCKET)
-                    continue;
-                FD_SET(pnode->hSocket, &fdsetError);
-                hSocketMax = std::max(hSocketMax, pnode->hSocket);
-                have_fds = true;
-
-                // Implement the following logic:
-                // * If there is data to send, select() for sending data. As this only
-                //   happens when optimistic write failed, we choose to first drain the
-                //   write buffer in this case before receiving more. This avoids
-                //   needlessly queueing received data, if the remote peer is not themselves
-                //   receiving data. This means properly utilizing TCP flow control signalling.
-                // * Otherwise, if there is no (complete) message in the receive buffer,
-                //   or there is space left in the buffer, select() for receiving data.
-                // * (if neither of the above applies, there is certainly one message
-                //   in the receiver buffer ready to be processed).
-                // Together, that means that at least one of the following is always possible,
-                // so we don't deadlock:
-                // * We send some data.
-                // * We wait for data to be received (and disconnect after timeout).
-                // * We process a message in the buffer (message handler thread).
-                {
-                    TRY_LOCK(pnode->cs_vSend, lockSend);
-                    if (lockSend && !pnode->vSendMsg.empty()) {
-                        FD_SET(pnode->hSocket, &fdsetSend);
-                        continue;
-                    }
-                }
-                {
-                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
-                        FD_SET(pnode->hSocket, &fdsetRecv);
-                }
-            }
-        }
-
-        int nSelect = select(have_fds ? hSocketMax + 1 : 0,
-                             &fdsetRecv, &fdsetSend, &fdsetError, &timeout);
-        boost::this_thread::interruption_point();
-
-        if (nSelect == SOCKET_ERROR)
-        {
-            if (have_fds)
-            {
-                int nErr = WSAGetLastError();
-                LogPrintf("socket select error %s\n", NetworkErrorString(nErr));
-                for (unsigned int i = 0; i <= hSocketMax; i++)
-                    FD_SET(i, &fdsetRecv);
-            }
-            FD_ZERO(&fdsetSend);
-            FD_ZERO(&fdsetError);
-            MilliSleep(timeout.tv_usec/1000);
-        }
+        std::set<SOCKET> setRecv, setSend, setError;
+        int64_t nWaitMicros = 0;
+#ifdef HAVE_SYS_EPOLL_H
+        if (nSocketEventsMode == SOCKETEVENTS_EPOLL)
+            SocketEventsEpoll(epoll.h, setRecv, setSend, setError, nWaitMicros);
+        else
+#endif
+            SocketEventsSelect(setRecv, setSend, setError, nWaitMicros);
 
         //
         // Accept new connections
         //
         BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
         {
-            if (hListenSocket.socket != INVALID_SOCKET && FD_ISSET(hListenSocket.socket, &fdsetRecv))
+            if (hListenSocket.socket != INVALID_SOCKET && setRecv.count(hListenSocket.socket))
             {
                 AcceptConnection(hListenSocket);
             }
@@ -1268,7 +1538,7 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            if (setRecv.count(pnode->hSocket) || setError.count(pnode->hSocket))
             {
                 TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
                 if (lockRecv)
@@ -1276,10 +1546,18 @@ void ThreadSocketHandler()
                     {
                         // typical socket buffer is 8K-64K
                         char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+                        // Large payloads are received straight into their message
+                        unsigned int nRecvSize = sizeof(pchBuf);
+                        char* pchInPlace = pnode->GetInPlaceRecvBuffer(nRecvSize);
+                        int nBytes = recv(pnode->hSocket, pchInPlace ? pchInPlace : pchBuf, nRecvSize, MSG_DONTWAIT);
+                        // A short read means the kernel buffer is drained; wait for the next edge
+                        if (nBytes >= 0 ? nBytes < (int)nRecvSize : WSAGetLastError() == WSAEWOULDBLOCK)
+                            pnode->fSocketReadable = false;
                         if (nBytes > 0)
                         {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+                            if (pchInPlace)
+                                pnode->ReceivedMsgBytesInPlace(nBytes);
+                            else if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
                                 pnode->CloseSocketDisconnect();
                             pnode->nLastRecv = GetTime();
                             pnode->nRecvBytes += nBytes;
@@ -1312,11 +1590,15 @@ void ThreadSocketHandler()
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            if (setSend.count(pnode->hSocket))
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
+                if (lockSend) {
                     SocketSendData(pnode);
+                    // Data left over means the kernel buffer is full; wait for the next edge
+                    if (!pnode->vSendMsg.empty())
+                        pnode->fSocketWritable = false;
+                }
             }
 
             //
@@ -1352,6 +1634,15 @@ void ThreadSocketHandler()
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
                 pnode->Release();
         }
+
+        int64_t nBusy = GetTimeMicros() - nIterationStart - nWaitMicros;
+        {
+            LOCK(cs_socketHandlerStats);
+            socketHandlerStats.nIterations++;
+            socketHandlerStats.nWaitMicros += nWaitMicros;
+            socketHandlerStats.nBusyMicros += nBusy;
+            socketHandlerStats.nMaxBusyMicros = std::max(socketHandlerStats.nMaxBusyMicros, nBusy);
+        }
     }
 }
 
@@ -1842,7 +2133,7 @@ bool OpenNetworkConnection(const CAddress& addrConnect, bool fCountFailure, CSem
 }
 
 
-void ThreadMessageHandler()
+void ThreadMessageHandler(int nThread)
 {
     boost::mutex condition_mutex;
     boost::unique_lock<boost::mutex> lock(condition_mutex);
@@ -1852,9 +2143,12 @@ void ThreadMessageHandler()
         std::vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
-            vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy) {
+            vNodesCopy.reserve(vNodes.size() / nMessageHandlerThreads + 1);
+            BOOST_FOREACH(CNode* pnode, vNodes) {
+                if (GetMessageHandlerThread(pnode->id) != nThread)
+                    continue;
                 pnode->AddRef();
+                vNodesCopy.push_back(pnode);
             }
         }
 
@@ -1900,7 +2194,7 @@ void ThreadMessageHandler()
         }
 
         if (fSleep)
-            messageHandlerCondition.timed_wait(lock, boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(100));
+            messageHandlerCondition[nThread].timed_wait(lock, boost::posix_time::microsec_clock::universal_time() + boost::posix_time::milliseconds(100));
     }
 }
 
@@ -1931,7 +2225,7 @@ bool BindListenPort(const CService &addrBind, std::string& strError, bool fWhite
         LogPrintf("%s\n", strError);
         return false;
     }
-    if (!IsSelectableSocket(hListenSocket))
+    if (nSocketEventsMode == SOCKETEVENTS_SELECT && !IsSelectableSocket(hListenSocket))
     {
         strError = "Error: Couldn't create a listenable socket for incoming connections";
         LogPrintf("%s\n", strError);
@@ -2128,8 +2422,12 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
     // Initiate outbound connections
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "opencon", &ThreadOpenConnections));
 
-    // Process messages
-    threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
+    // Process messages, spreading the peers over nMessageHandlerThreads threads
+    LogPrintf("Using %d threads for peer message processing\n", nMessageHandlerThreads);
+    for (int i = 0; i < nMessageHandlerThreads; i++) {
+        boost::function<void()> messageHandler = boost::bind(&ThreadMessageHandler, i);
+        threadGroup.create_thread(boost::bind(&TraceThread<boost::function<void()> >, "msghand", messageHandler));
+    }
 
     // Dump network addresses
     scheduler.scheduleEvery(&DumpData, DUMP_ADDRESSES_INTERVAL);
@@ -2482,6 +2780,9 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
     fNetworkNode = false;
     fSuccessfullyConnected = false;
     fDisconnect = false;
+    fSocketRegistered = false;
+    fSocketReadable = false;
+    fSocketWritable = false;
     nRefCount = 0;
     nSendSize = 0;
     nSendOffset = 0;
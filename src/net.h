@@ -53,6 +53,16 @@ static const unsigned int MAX_PROTOCOL_MESSAGE_LENGTH = 4 * 1000 * 1000;
 static const unsigned int MAX_SUBVERSION_LENGTH = 256;
 /** -listen default */
 static const bool DEFAULT_LISTEN = true;
+/** -socketevents default */
+#ifdef HAVE_SYS_EPOLL_H
+static const char* const DEFAULT_SOCKETEVENTS = "epoll";
+#else
+static const char* const DEFAULT_SOCKETEVENTS = "select";
+#endif
+/** -msghandthreads default */
+static const int DEFAULT_MSGHAND_THREADS = 2;
+/** Maximum number of message handler threads */
+static const int MAX_MSGHAND_THREADS = 16;
 /** -upnp default */
 #ifdef USE_UPNP
 static const bool DEFAULT_UPNP = USE_UPNP;
@@ -166,6 +176,39 @@ extern CAddrMan addrman;
 /** Maximum number of connections to simultaneously allow (aka connection slots) */
 extern int nMaxConnections;
 
+/**
+ * Number of threads processing peer messages (-msghandthreads). A peer is
+ * always served by the same thread, so its messages are still handled in order.
+ */
+extern int nMessageHandlerThreads;
+
+/** How the socket handler thread waits for its sockets to become ready (-socketevents) */
+enum SocketEventsMode
+{
+    SOCKETEVENTS_SELECT,
+    SOCKETEVENTS_EPOLL,
+};
+
+extern SocketEventsMode nSocketEventsMode;
+
+/** Parse a -socketevents value. Fails for unknown modes and ones this build does not support. */
+bool ParseSocketEventsMode(const std::string& strMode, SocketEventsMode& mode);
+std::string GetSocketEventsModeName(SocketEventsMode mode);
+
+/** Timings of the socket handler loop */
+struct CSocketHandlerStats
+{
+    uint64_t nIterations;
+    //! Total time spent waiting for socket events
+    int64_t nWaitMicros;
+    //! Total time spent on everything else: disconnecting, accepting, receiving and sending
+    int64_t nBusyMicros;
+    //! Most time spent on everything else in a single iteration
+    int64_t nMaxBusyMicros;
+};
+
+void GetSocketHandlerStats(CSocketHandlerStats& stats);
+
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
 extern limitedmap<uint256, int64_t> mapAlreadyAskedFor;
@@ -253,6 +296,14 @@ public:
 
     int readHeader(const char *pch, unsigned int nBytes);
     int readData(const char *pch, unsigned int nBytes);
+
+    /**
+     * Make room for nBytes more payload bytes (at most the rest of the
+     * message) and return where they go, so they can be received there
+     * directly. Call DataReceived with the number actually written.
+     */
+    char* GetDataBuffer(unsigned int nBytes);
+    void DataReceived(unsigned int nBytes);
 };
 
 
@@ -359,6 +410,10 @@ public:
     bool fNetworkNode;
     bool fSuccessfullyConnected;
     bool fDisconnect;
+    // Edge-triggered socket events state, only used by the socket handler thread
+    bool fSocketRegistered;
+    bool fSocketReadable;
+    bool fSocketWritable;
     // We use fRelayTxes for two purposes -
     // a) it allows us to not relay tx invs before receiving the peer's version message
     // b) the peer may tell us in its version message that we should not relay tx invs
@@ -395,7 +450,9 @@ public:
     uint256 hashContinue;
     int nStartingHeight;
 
-    // flood relay
+    // flood relay, vAddrToSend and addrKnown are protected by cs_addrRelay
+    // as other peers' message handlers may push addresses to us
+    CCriticalSection cs_addrRelay;
     std::vector<CAddress> vAddrToSend;
     CRollingBloomFilter addrKnown;
     bool fGetAddr;
@@ -467,6 +524,9 @@ private:
 
     static uint64_t CalculateKeyedNetGroup(const CAddress& ad);
 
+    // Account for a fully received message and wake the message handler. requires LOCK(cs_vRecvMsg)
+    void MessageComplete(CNetMessage& msg);
+
 public:
 
     NodeId GetId() const {
@@ -491,6 +551,17 @@ public:
     // requires LOCK(cs_vRecvMsg)
     bool ReceiveMsgBytes(const char *pch, unsigned int nBytes);
 
+    /**
+     * If a message payload with at least nBytes still to come is being
+     * received, return where the next nBytes of it go, so the socket can be
+     * read into it directly (followed by ReceivedMsgBytesInPlace). Returns
+     * NULL otherwise.
+     * requires LOCK(cs_vRecvMsg)
+     */
+    char* GetInPlaceRecvBuffer(unsigned int nBytes);
+    // requires LOCK(cs_vRecvMsg)
+    void ReceivedMsgBytesInPlace(unsigned int nBytes);
+
     // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
     {
@@ -514,6 +585,7 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
+        LOCK(cs_addrRelay);
         addrKnown.insert(addr.GetKey());
     }
 
@@ -522,6 +594,7 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
+        LOCK(cs_addrRelay);
         if (addr.IsValid() && !addrKnown.contains(addr.GetKey())) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand() % vAddrToSend.size()] = addr;
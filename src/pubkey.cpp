@@ -165,13 +165,29 @@ static int ecdsa_signature_parse_der_lax(const secp256k1_context* ctx, secp256k1
 }
 
 bool CPubKey::Verify(const uint256 &hash, const std::vector<unsigned char>& vchSig) const {
+    CParsedPubKey parsed;
+    if (!Parse(parsed)) {
+        return false;
+    }
+    return VerifyParsed(parsed, hash, vchSig);
+}
+
+bool CPubKey::Parse(CParsedPubKey& parsed) const {
+    static_assert(sizeof(CParsedPubKey) == sizeof(secp256k1_pubkey), "CParsedPubKey must hold a secp256k1_pubkey");
     if (!IsValid())
         return false;
     secp256k1_pubkey pubkey;
-    secp256k1_ecdsa_signature sig;
     if (!secp256k1_ec_pubkey_parse(secp256k1_context_verify, &pubkey, &(*this)[0], size())) {
         return false;
     }
+    memcpy(parsed.data, pubkey.data, sizeof(parsed.data));
+    return true;
+}
+
+/* static */ bool CPubKey::VerifyParsed(const CParsedPubKey& parsed, const uint256 &hash, const std::vector<unsigned char>& vchSig) {
+    secp256k1_pubkey pubkey;
+    secp256k1_ecdsa_signature sig;
+    memcpy(pubkey.data, parsed.data, sizeof(pubkey.data));
     if (vchSig.size() == 0) {
         return false;
     }
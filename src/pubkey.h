@@ -35,6 +35,16 @@ public:
 
 typedef uint256 ChainCode;
 
+/**
+ * A public key in the parsed form libsecp256k1 verifies against. Parsing
+ * a compressed key takes a square root, so callers that see the same key
+ * many times can keep this around (see CPubKey::Parse).
+ */
+struct CParsedPubKey
+{
+    unsigned char data[64];
+};
+
 /** An encapsulated public key. */
 class CPubKey
 {
@@ -179,6 +189,12 @@ public:
      */
     bool Verify(const uint256& hash, const std::vector<unsigned char>& vchSig) const;
 
+    //! Parse this public key for use with VerifyParsed. Fails if it is not fully valid.
+    bool Parse(CParsedPubKey& parsed) const;
+
+    //! Verify a DER signature against a public key parsed earlier with Parse.
+    static bool VerifyParsed(const CParsedPubKey& parsed, const uint256& hash, const std::vector<unsigned char>& vchSig);
+
     /**
      * Check whether a signature is normalized (lower-S).
      */
@@ -13,6 +13,7 @@
 #include "policy/policy.h"
 #include "primitives/transaction.h"
 #include "rpc/server.h"
+#include "script/sigcache.h"
 #include "streams.h"
 #include "sync.h"
 #include "txmempool.h"
@@ -1111,6 +1112,54 @@ UniValue getmempoolinfo(const UniValue& params, bool fHelp)
     return mempoolInfoToJSON();
 }
 
+static UniValue SigCacheStatsToJSON(const CSignatureCacheStats& stats)
+{
+    UniValue ret(UniValue::VOBJ);
+    ret.push_back(Pair("entries", (uint64_t)stats.nEntries));
+    ret.push_back(Pair("capacity", (uint64_t)stats.nCapacity));
+    ret.push_back(Pair("bytes", (uint64_t)stats.nBytes));
+    ret.push_back(Pair("hits", stats.nHits));
+    ret.push_back(Pair("misses", stats.nMisses));
+    ret.push_back(Pair("inserts", stats.nInserts));
+    ret.push_back(Pair("evictions", stats.nEvictions));
+    ret.push_back(Pair("contended", stats.nContended));
+    return ret;
+}
+
+UniValue getsigcacheinfo(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() != 0)
+        throw runtime_error(
+            "getsigcacheinfo\n"
+            "\nReturns details on the signature cache and the script execution cache.\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"entries\": xxxxx,           (numeric) Number of cached valid signatures\n"
+            "  \"capacity\": xxxxx,          (numeric) Number of signatures the cache can hold\n"
+            "  \"bytes\": xxxxx,             (numeric) Memory allocated for the cache\n"
+            "  \"hits\": xxxxx,              (numeric) Lookups that found a signature\n"
+            "  \"misses\": xxxxx,            (numeric) Lookups that did not\n"
+            "  \"inserts\": xxxxx,           (numeric) Signatures added to the cache\n"
+            "  \"evictions\": xxxxx,         (numeric) Cached signatures overwritten by newer ones\n"
+            "  \"contended\": xxxxx,         (numeric) Lookups and inserts that had to wait for a lock\n"
+            "  \"scriptexecution\": {        (json object) The same for transactions whose scripts all passed\n"
+            "     ...\n"
+            "  }\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getsigcacheinfo", "")
+            + HelpExampleRpc("getsigcacheinfo", "")
+        );
+
+    CSignatureCacheStats stats;
+    GetSignatureCacheStats(stats);
+    UniValue ret = SigCacheStatsToJSON(stats);
+
+    GetScriptExecutionCacheStats(stats);
+    ret.push_back(Pair("scriptexecution", SigCacheStatsToJSON(stats)));
+    return ret;
+}
+
 UniValue invalidateblock(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -1202,6 +1251,7 @@ static const CRPCCommand commands[] =
     { "blockchain",         "getmempoolentry",        &getmempoolentry,        true  },
     { "blockchain",         "getmempoolinfo",         &getmempoolinfo,         true  },
     { "blockchain",         "getrawmempool",          &getrawmempool,          true  },
+    { "blockchain",         "getsigcacheinfo",        &getsigcacheinfo,        true  },
     { "blockchain",         "gettxout",               &gettxout,               true  },
     { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        true  },
     { "blockchain",         "verifychain",            &verifychain,            true  },
@@ -353,6 +353,14 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
             "    \"serve_historical_blocks\": true|false,  (boolean) True if serving historical blocks\n"
             "    \"bytes_left_in_cycle\": t,               (numeric) Bytes left in current time cycle\n"
             "    \"time_left_in_cycle\": t                 (numeric) Seconds left in current time cycle\n"
+            "  },\n"
+            "  \"sockethandler\":\n"
+            "  {\n"
+            "    \"socketevents\": \"mode\",   (string) How the socket handler waits for socket events (see -socketevents)\n"
+            "    \"iterations\": n,           (numeric) Iterations of the socket handler loop\n"
+            "    \"wait_micros\": n,          (numeric) Total time spent waiting for socket events\n"
+            "    \"busy_micros\": n,          (numeric) Total time spent servicing sockets\n"
+            "    \"max_busy_micros\": n       (numeric) Most time spent servicing sockets in one iteration\n"
             "  }\n"
             "}\n"
             "\nExamples:\n"
@@ -373,6 +381,16 @@ UniValue getnettotals(const UniValue& params, bool fHelp)
     outboundLimit.push_back(Pair("bytes_left_in_cycle", CNode::GetOutboundTargetBytesLeft()));
     outboundLimit.push_back(Pair("time_left_in_cycle", CNode::GetMaxOutboundTimeLeftInCycle()));
     obj.push_back(Pair("uploadtarget", outboundLimit));
+
+    CSocketHandlerStats socketHandlerStats;
+    GetSocketHandlerStats(socketHandlerStats);
+    UniValue socketHandler(UniValue::VOBJ);
+    socketHandler.push_back(Pair("socketevents", GetSocketEventsModeName(nSocketEventsMode)));
+    socketHandler.push_back(Pair("iterations", socketHandlerStats.nIterations));
+    socketHandler.push_back(Pair("wait_micros", socketHandlerStats.nWaitMicros));
+    socketHandler.push_back(Pair("busy_micros", socketHandlerStats.nBusyMicros));
+    socketHandler.push_back(Pair("max_busy_micros", socketHandlerStats.nMaxBusyMicros));
+    obj.push_back(Pair("sockethandler", socketHandler));
     return obj;
 }
 
@@ -5,105 +5,278 @@
 
 #include "sigcache.h"
 
-#include "memusage.h"
+#include "hash.h"
 #include "pubkey.h"
 #include "random.h"
 #include "uint256.h"
 #include "util.h"
 
-#include <boost/thread.hpp>
-#include <boost/unordered_set.hpp>
+#include <atomic>
 
-namespace {
+#include <boost/thread.hpp>
 
-/**
- * We're hashing a nonce into the entries themselves, so we don't need extra
- * blinding in the set hash computation.
- */
-class CSignatureCacheHasher
+/** One lock's worth of cache slots */
+struct CSignatureCache::Shard
 {
-public:
-    size_t operator()(const uint256& key) const {
-        return key.GetCheapHash();
-    }
-};
+    mutable boost::shared_mutex cs;
+    std::vector<uint256> vEntries;
+    //! Generation each slot was filled in, 0 for empty slots
+    std::vector<unsigned char> vGeneration;
+    unsigned char nGeneration;
+    size_t nGenerationInserts;
+    size_t nEntries;
 
-/**
- * Valid signature cache, to avoid doing expensive ECDSA signature checking
- * twice for every transaction (once when accepted into memory pool, and
- * again when accepted into the block chain)
- */
-class CSignatureCache
-{
-private:
-     //! Entries are SHA256(nonce || signature hash || public key || signature):
-    uint256 nonce;
-    typedef boost::unordered_set<uint256, CSignatureCacheHasher> map_type;
-    map_type setValid;
-    boost::shared_mutex cs_sigcache;
+    std::atomic<uint64_t> nHits;
+    std::atomic<uint64_t> nMisses;
+    std::atomic<uint64_t> nInserts;
+    std::atomic<uint64_t> nEvictions;
+    std::atomic<uint64_t> nContended;
 
+    Shard() : nGeneration(1), nGenerationInserts(0), nEntries(0), nHits(0), nMisses(0), nInserts(0), nEvictions(0), nContended(0) {}
 
-public:
-    CSignatureCache()
+    //! Take a lock, counting it if someone else holds it
+    template<typename Lock>
+    void Acquire(Lock& lock)
     {
-        GetRandBytes(nonce.begin(), 32);
+        if (!lock.try_lock()) {
+            nContended++;
+            lock.lock();
+        }
     }
 
-    void
-    ComputeEntry(uint256& entry, const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubkey)
+    //! The first slots of the two buckets an entry may live in
+    void GetBuckets(const uint256& entry, size_t nBuckets, size_t (&pos)[2]) const
     {
-        CSHA256().Write(nonce.begin(), 32).Write(hash.begin(), 32).Write(&pubkey[0], pubkey.size()).Write(&vchSig[0], vchSig.size()).Finalize(entry.begin());
+        pos[0] = (entry.GetUint64(1) % nBuckets) * WAYS;
+        pos[1] = (entry.GetUint64(2) % nBuckets) * WAYS;
     }
 
-    bool
-    Get(const uint256& entry)
+    bool Find(const uint256& entry, size_t nBuckets, size_t& posFound) const
     {
-        boost::shared_lock<boost::shared_mutex> lock(cs_sigcache);
-        return setValid.count(entry);
+        size_t pos[2];
+        GetBuckets(entry, nBuckets, pos);
+        for (int i = 0; i < 2; i++) {
+            for (size_t n = pos[i]; n < pos[i] + WAYS; n++) {
+                if (vGeneration[n] != 0 && vEntries[n] == entry) {
+                    posFound = n;
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+};
+
+CSignatureCache::CSignatureCache(size_t nBytes)
+{
+    GetRandBytes(nonce.begin(), 32);
+    nBucketsPerShard = nBytes / (SHARDS * WAYS * (sizeof(uint256) + 1));
+    shards.reset(new Shard[SHARDS]);
+    for (unsigned int i = 0; i < SHARDS; i++) {
+        shards[i].vEntries.resize(nBucketsPerShard * WAYS);
+        shards[i].vGeneration.resize(nBucketsPerShard * WAYS, 0);
     }
+}
+
+CSignatureCache::~CSignatureCache()
+{
+}
 
-    void Erase(const uint256& entry)
+void CSignatureCache::ComputeEntry(uint256& entry, const uint256 &hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubkey) const
+{
+    CSHA256().Write(nonce.begin(), 32).Write(hash.begin(), 32).Write(&pubkey[0], pubkey.size()).Write(&vchSig[0], vchSig.size()).Finalize(entry.begin());
+}
+
+CSignatureCache::Shard& CSignatureCache::GetShard(const uint256& entry) const
+{
+    // Entries are salted hashes, so their bits can pick the slots directly
+    return shards[entry.GetUint64(0) % SHARDS];
+}
+
+bool CSignatureCache::Get(const uint256& entry, bool fErase)
+{
+    if (nBucketsPerShard == 0)
+        return false;
+    Shard& shard = GetShard(entry);
+    size_t pos;
     {
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
-        setValid.erase(entry);
+        boost::shared_lock<boost::shared_mutex> lock(shard.cs, boost::defer_lock);
+        shard.Acquire(lock);
+        if (!shard.Find(entry, nBucketsPerShard, pos)) {
+            shard.nMisses++;
+            return false;
+        }
     }
+    shard.nHits++;
+    if (fErase) {
+        boost::unique_lock<boost::shared_mutex> lock(shard.cs, boost::defer_lock);
+        shard.Acquire(lock);
+        if (shard.Find(entry, nBucketsPerShard, pos)) {
+            shard.vGeneration[pos] = 0;
+            shard.nEntries--;
+        }
+    }
+    return true;
+}
+
+void CSignatureCache::Set(const uint256& entry)
+{
+    if (nBucketsPerShard == 0)
+        return;
+    Shard& shard = GetShard(entry);
+    boost::unique_lock<boost::shared_mutex> lock(shard.cs, boost::defer_lock);
+    shard.Acquire(lock);
+    size_t pos;
+    if (shard.Find(entry, nBucketsPerShard, pos))
+        return;
 
-    void Set(const uint256& entry)
+    // Take an empty slot, or else the one filled the most generations ago
+    size_t buckets[2];
+    shard.GetBuckets(entry, nBucketsPerShard, buckets);
+    size_t posVictim = buckets[0];
+    int nVictimAge = -1;
+    for (int i = 0; i < 2 && nVictimAge < 256; i++) {
+        for (size_t n = buckets[i]; n < buckets[i] + WAYS; n++) {
+            if (shard.vGeneration[n] == 0) {
+                posVictim = n;
+                nVictimAge = 256;
+                break;
+            }
+            int nAge = (unsigned char)(shard.nGeneration - shard.vGeneration[n]);
+            if (nAge > nVictimAge) {
+                posVictim = n;
+                nVictimAge = nAge;
+            }
+        }
+    }
+    if (shard.vGeneration[posVictim] != 0)
+        shard.nEvictions++;
+    else
+        shard.nEntries++;
+    shard.vEntries[posVictim] = entry;
+    shard.vGeneration[posVictim] = shard.nGeneration;
+    shard.nInserts++;
+
+    // A generation lasts for an eighth of the shard's slots worth of inserts
+    if (++shard.nGenerationInserts >= std::max<size_t>(1, shard.vEntries.size() / 8)) {
+        shard.nGenerationInserts = 0;
+        if (++shard.nGeneration == 0)
+            shard.nGeneration = 1;
+    }
+}
+
+void CSignatureCache::GetStats(CSignatureCacheStats& stats) const
+{
+    stats = CSignatureCacheStats();
+    for (unsigned int i = 0; i < SHARDS; i++) {
+        const Shard& shard = shards[i];
+        stats.nHits += shard.nHits;
+        stats.nMisses += shard.nMisses;
+        stats.nInserts += shard.nInserts;
+        stats.nEvictions += shard.nEvictions;
+        stats.nContended += shard.nContended;
+        {
+            boost::shared_lock<boost::shared_mutex> lock(shard.cs);
+            stats.nEntries += shard.nEntries;
+        }
+        stats.nCapacity += shard.vEntries.size();
+    }
+    stats.nBytes = stats.nCapacity * (sizeof(uint256) + 1);
+}
+
+namespace {
+
+/**
+ * Cache of parsed public keys, so keys that sign many inputs are only
+ * decompressed once. It is direct-mapped: a key's slot is picked by a
+ * salted hash of its serialization (so nobody can make their keys evict
+ * everyone else's), and a new key simply overwrites the slot's old one.
+ * The slots are split over shards with a lock each, to keep the script
+ * check threads from contending.
+ */
+class CParsedPubKeyCache
+{
+private:
+    static const unsigned int SHARDS = 16;
+    static const unsigned int SLOTS_PER_SHARD = 512;
+
+    struct Entry
+    {
+        CPubKey pubkey;
+        CParsedPubKey parsed;
+    };
+
+    struct Shard
     {
-        size_t nMaxCacheSize = GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE) * ((size_t) 1 << 20);
-        if (nMaxCacheSize <= 0) return;
+        boost::mutex cs;
+        Entry entries[SLOTS_PER_SHARD];
+    };
 
-        boost::unique_lock<boost::shared_mutex> lock(cs_sigcache);
-        while (memusage::DynamicUsage(setValid) > nMaxCacheSize)
+    uint64_t k0, k1;
+    Shard shards[SHARDS];
+
+public:
+    CParsedPubKeyCache()
+    {
+        GetRandBytes((unsigned char*)&k0, sizeof(k0));
+        GetRandBytes((unsigned char*)&k1, sizeof(k1));
+    }
+
+    bool Parse(const CPubKey& pubkey, CParsedPubKey& parsed)
+    {
+        if (!pubkey.IsValid())
+            return false;
+        uint64_t hash = CSipHasher(k0, k1).Write(pubkey.begin(), pubkey.size()).Finalize();
+        Shard& shard = shards[hash % SHARDS];
+        Entry& entry = shard.entries[(hash / SHARDS) % SLOTS_PER_SHARD];
         {
-            map_type::size_type s = GetRand(setValid.bucket_count());
-            map_type::local_iterator it = setValid.begin(s);
-            if (it != setValid.end(s)) {
-                setValid.erase(*it);
+            boost::unique_lock<boost::mutex> lock(shard.cs);
+            if (entry.pubkey == pubkey) {
+                parsed = entry.parsed;
+                return true;
             }
         }
-
-        setValid.insert(entry);
+        if (!pubkey.Parse(parsed))
+            return false;
+        boost::unique_lock<boost::mutex> lock(shard.cs);
+        entry.pubkey = pubkey;
+        entry.parsed = parsed;
+        return true;
     }
 };
 
 }
 
+size_t GetMaxSigCacheBytes()
+{
+    return std::max((int64_t)0, GetArg("-maxsigcachesize", DEFAULT_MAX_SIG_CACHE_SIZE)) * ((size_t) 1 << 20) / 2;
+}
+
+static CSignatureCache& GetSignatureCache()
+{
+    static CSignatureCache signatureCache(GetMaxSigCacheBytes());
+    return signatureCache;
+}
+
+void GetSignatureCacheStats(CSignatureCacheStats& stats)
+{
+    GetSignatureCache().GetStats(stats);
+}
+
 bool CachingTransactionSignatureChecker::VerifySignature(const std::vector<unsigned char>& vchSig, const CPubKey& pubkey, const uint256& sighash) const
 {
-    static CSignatureCache signatureCache;
+    CSignatureCache& signatureCache = GetSignatureCache();
 
     uint256 entry;
     signatureCache.ComputeEntry(entry, sighash, vchSig, pubkey);
 
-    if (signatureCache.Get(entry)) {
-        if (!store) {
-            signatureCache.Erase(entry);
-        }
+    if (signatureCache.Get(entry, !store))
         return true;
-    }
 
-    if (!TransactionSignatureChecker::VerifySignature(vchSig, pubkey, sighash))
+    static CParsedPubKeyCache pubkeyCache;
+
+    CParsedPubKey parsed;
+    if (!pubkeyCache.Parse(pubkey, parsed) || !CPubKey::VerifyParsed(parsed, sighash, vchSig))
         return false;
 
     if (store) {
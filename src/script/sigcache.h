@@ -8,14 +8,78 @@
 
 #include "script/interpreter.h"
 
+#include <memory>
 #include <vector>
 
-// DoS prevention: limit cache size to less than 40MB (over 500000
-// entries on 64-bit systems).
+// DoS prevention: limit cache size to 40MB, allocated up front and split
+// equally between the signature cache (about 600000 entries) and the script
+// execution cache.
 static const unsigned int DEFAULT_MAX_SIG_CACHE_SIZE = 40;
 
 class CPubKey;
 
+/** Counters of a CSignatureCache */
+struct CSignatureCacheStats
+{
+    uint64_t nHits;
+    uint64_t nMisses;
+    uint64_t nInserts;
+    //! Valid entries overwritten to make room for new ones
+    uint64_t nEvictions;
+    //! Lookups and inserts that had to wait for their shard's lock
+    uint64_t nContended;
+    size_t nEntries;
+    size_t nCapacity;
+    size_t nBytes;
+};
+
+/**
+ * Valid signature cache, to avoid doing expensive ECDSA signature checking
+ * twice for every transaction (once when accepted into memory pool, and
+ * again when accepted into the block chain).
+ *
+ * All memory is allocated when the cache is created. Entries are spread
+ * over shards with a lock each, so script check threads rarely wait on
+ * one another. Within a shard an entry can live in either of two buckets
+ * of a few slots. A new entry takes an empty slot of those, or else evicts
+ * the one inserted longest ago: every shard counts generations of inserts,
+ * and each slot remembers the generation it was filled in.
+ */
+class CSignatureCache
+{
+public:
+    static const unsigned int SHARDS = 32;
+    static const unsigned int WAYS = 4;
+
+    //! Create a cache using at most nBytes of memory (0 disables it)
+    explicit CSignatureCache(size_t nBytes);
+    ~CSignatureCache();
+
+    //! Entries are SHA256(nonce || signature hash || public key || signature)
+    void ComputeEntry(uint256& entry, const uint256& hash, const std::vector<unsigned char>& vchSig, const CPubKey& pubkey) const;
+
+    //! Look an entry up, and drop it if found and fErase is set
+    bool Get(const uint256& entry, bool fErase);
+    void Set(const uint256& entry);
+
+    void GetStats(CSignatureCacheStats& stats) const;
+
+private:
+    struct Shard;
+
+    uint256 nonce;
+    size_t nBucketsPerShard;
+    std::unique_ptr<Shard[]> shards;
+
+    Shard& GetShard(const uint256& entry) const;
+};
+
+/** Memory for each of the caches sharing -maxsigcachesize */
+size_t GetMaxSigCacheBytes();
+
+/** Counters of the cache used by CachingTransactionSignatureChecker */
+void GetSignatureCacheStats(CSignatureCacheStats& stats);
+
 class CachingTransactionSignatureChecker : public TransactionSignatureChecker
 {
 private:
@@ -0,0 +1,95 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "checkqueue.h"
+#include "random.h"
+
+#include "test/test_bitcoin.h"
+
+#include <atomic>
+
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(checkqueue_tests, BasicTestingSetup)
+
+namespace {
+
+std::atomic<int> nChecked(0);
+
+struct CountingCheck
+{
+    bool fOk;
+
+    CountingCheck(bool fOkIn = true) : fOk(fOkIn) {}
+
+    bool operator()()
+    {
+        nChecked++;
+        return fOk;
+    }
+
+    void swap(CountingCheck& check)
+    {
+        std::swap(fOk, check.fOk);
+    }
+};
+
+}
+
+/** Run rounds of random batches through a queue with nWorkers worker threads */
+static void RunRounds(int nWorkers, int nQueues)
+{
+    CCheckQueue<CountingCheck> queue(16, nQueues);
+    boost::thread_group threadGroup;
+    for (int i = 0; i < nWorkers; i++)
+        threadGroup.create_thread(boost::bind(&CCheckQueue<CountingCheck>::Thread, &queue));
+
+    for (int nRound = 0; nRound < 200; nRound++) {
+        nChecked = 0;
+        int nTotal = 0;
+        // Every fifth round has a failing check somewhere
+        int nFail = nRound % 5 == 4 ? insecure_rand() % 1000 : -1;
+        {
+            CCheckQueueControl<CountingCheck> control(&queue);
+            int nBatches = insecure_rand() % 10;
+            for (int i = 0; i < nBatches; i++) {
+                std::vector<CountingCheck> vChecks;
+                for (int j = insecure_rand() % 200; j > 0; j--)
+                    vChecks.push_back(CountingCheck(nTotal++ != nFail));
+                control.Add(vChecks);
+            }
+            bool fOk = control.Wait();
+            BOOST_CHECK_EQUAL(fOk, nFail < 0 || nFail >= nTotal);
+        }
+        BOOST_CHECK(queue.IsIdle());
+        // After a failure the remaining checks may be skipped.
+        if (nFail < 0 || nFail >= nTotal)
+            BOOST_CHECK_EQUAL(nChecked, nTotal);
+        else
+            BOOST_CHECK(nChecked <= nTotal);
+    }
+
+    threadGroup.interrupt_all();
+    threadGroup.join_all();
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_no_workers)
+{
+    RunRounds(0, 64);
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_workers)
+{
+    RunRounds(3, 64);
+}
+
+BOOST_AUTO_TEST_CASE(checkqueue_shared_deques)
+{
+    // More workers than deques, so some share one
+    RunRounds(6, 3);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
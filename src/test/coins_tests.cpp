@@ -9,6 +9,7 @@
 #include "utilstrencodings.h"
 #include "test/test_bitcoin.h"
 #include "main.h"
+#include "txdb.h"
 #include "consensus/validation.h"
 
 #include <vector>
@@ -75,13 +76,65 @@ public:
         // Manually recompute the dynamic usage of the whole data, and compare it.
         size_t ret = memusage::DynamicUsage(cacheCoins);
         for (CCoinsMap::iterator it = cacheCoins.begin(); it != cacheCoins.end(); it++) {
-            ret += it->second.coins.DynamicMemoryUsage();
+            ret += it->second.coins.DynamicMemoryUsage() + it->second.baseAvail.DynamicMemoryUsage();
         }
         BOOST_CHECK_EQUAL(DynamicMemoryUsage(), ret);
     }
 
 };
 
+class CCoinsViewDBTest : public CCoinsViewDB
+{
+public:
+    CCoinsViewDBTest() : CCoinsViewDB(1 << 20, true) {}
+    CDBWrapper& GetDB() { return db; }
+};
+
+/** Database key of output n of txid in CCoinsViewDB: ('C', txid, VARINT(n)) */
+struct CoinKey
+{
+    char key;
+    uint256 hash;
+    uint32_t n;
+
+    CoinKey(const uint256 &hashIn, uint32_t nIn) : key('C'), hash(hashIn), n(nIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(key);
+        READWRITE(hash);
+        READWRITE(VARINT(n));
+    }
+};
+
+//! Whether txid has its header record and exactly the output records of coins
+bool HasRecordsFor(CCoinsViewDBTest &db, const uint256 &txid, const CCoins &coins, unsigned int nMaxOutputs)
+{
+    if (db.GetDB().Exists(std::make_pair('C', txid)) == coins.IsPruned())
+        return false;
+    for (unsigned int i = 0; i < nMaxOutputs; i++) {
+        if (db.GetDB().Exists(CoinKey(txid, i)) != coins.IsAvailable(i))
+            return false;
+    }
+    return true;
+}
+
+CCoins MakeTestCoins(unsigned int nOutputs, int nHeight, bool fCoinBase)
+{
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    if (!fCoinBase)
+        tx.vin[0].prevout = COutPoint(GetRandHash(), 0);
+    tx.vout.resize(nOutputs);
+    for (unsigned int i = 0; i < nOutputs; i++) {
+        tx.vout[i].nValue = 1000 + i;
+        tx.vout[i].scriptPubKey = CScript() << OP_TRUE << i;
+    }
+    return CCoins(tx, nHeight);
+}
+
 }
 
 BOOST_FIXTURE_TEST_SUITE(coins_tests, BasicTestingSetup)
@@ -415,4 +468,274 @@ BOOST_AUTO_TEST_CASE(ccoins_serialization)
     }
 }
 
+BOOST_FIXTURE_TEST_CASE(coins_db_per_output, TestingSetup)
+{
+    CCoinsViewDBTest db;
+    uint256 txid = GetRandHash();
+    CCoins coins = MakeTestCoins(20, 100, false);
+
+    {
+        CCoinsViewCache cache(&db);
+        *cache.ModifyNewCoins(txid, false) = coins;
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK(HasRecordsFor(db, txid, coins, 25));
+    CCoins stored;
+    BOOST_CHECK(db.GetCoins(txid, stored));
+    BOOST_CHECK(stored == coins);
+
+    // Spending a single output only removes that output's record, where the
+    // per-transaction format rewrote the whole transaction.
+    {
+        CCoinsViewCache cache(&db);
+        BOOST_CHECK(cache.ModifyCoins(txid)->Spend(2));
+        BOOST_CHECK(cache.Flush());
+    }
+    coins.Spend(2);
+    BOOST_CHECK(HasRecordsFor(db, txid, coins, 25));
+    CDBBatch expected(db.GetDB());
+    expected.Erase(CoinKey(txid, 2));
+    BOOST_CHECK_EQUAL(db.GetLastBatchSize(), expected.SizeEstimate());
+    CDBBatch legacy(db.GetDB());
+    legacy.Write(std::make_pair('c', txid), coins);
+    BOOST_CHECK(db.GetLastBatchSize() * 3 < legacy.SizeEstimate());
+    BOOST_CHECK(db.GetCoins(txid, stored));
+    BOOST_CHECK(stored == coins);
+    BOOST_CHECK_EQUAL(stored.nHeight, 100);
+
+    // The cursor gathers a transaction's outputs back into one CCoins.
+    {
+        boost::scoped_ptr<CCoinsViewCursor> pcursor(db.Cursor());
+        BOOST_CHECK(pcursor->Valid());
+        uint256 key;
+        CCoins cursorCoins;
+        BOOST_CHECK(pcursor->GetKey(key) && key == txid);
+        BOOST_CHECK(pcursor->GetValue(cursorCoins) && cursorCoins == coins);
+        pcursor->Next();
+        BOOST_CHECK(!pcursor->Valid());
+    }
+
+    // Spending everything leaves no records behind.
+    {
+        CCoinsViewCache cache(&db);
+        {
+            CCoinsModifier mod = cache.ModifyCoins(txid);
+            for (unsigned int i = 0; i < coins.vout.size(); i++)
+                mod->Spend(i);
+        }
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK(!db.HaveCoins(txid));
+    BOOST_CHECK(!db.GetCoins(txid, stored));
+    BOOST_CHECK(HasRecordsFor(db, txid, CCoins(), 25));
+
+    // A new coinbase is known not to be on disk and is written as is.
+    uint256 cbtxid = GetRandHash();
+    CCoins coinbase = MakeTestCoins(2, 300, true);
+    {
+        CCoinsViewCache cache(&db);
+        *cache.ModifyNewCoins(cbtxid, true) = coinbase;
+        BOOST_CHECK(cache.Flush());
+    }
+    BOOST_CHECK(HasRecordsFor(db, cbtxid, coinbase, 5));
+}
+
+BOOST_FIXTURE_TEST_CASE(coins_db_stacked_caches, TestingSetup)
+{
+    CCoinsViewDBTest db;
+    uint256 txid = GetRandHash();
+    CCoins coins = MakeTestCoins(4, 100, false);
+    uint256 cbtxid = GetRandHash();
+    CCoins coinbase = MakeTestCoins(5, 150, true);
+    {
+        CCoinsViewCache cache(&db);
+        *cache.ModifyNewCoins(txid, false) = coins;
+        *cache.ModifyNewCoins(cbtxid, true) = coinbase;
+        BOOST_CHECK(cache.Flush());
+    }
+
+    CCoinsViewCacheTest parent(&db);
+    BOOST_CHECK(parent.AccessCoins(txid));
+    BOOST_CHECK(parent.AccessCoins(cbtxid));
+
+    // A partial spend in the child reaches the database as a single erase.
+    {
+        CCoinsViewCacheTest child(&parent);
+        BOOST_CHECK(child.ModifyCoins(txid)->Spend(1));
+        child.SelfTest();
+        BOOST_CHECK(child.Flush());
+    }
+    parent.SelfTest();
+    BOOST_CHECK(parent.Flush());
+    coins.Spend(1);
+    BOOST_CHECK(HasRecordsFor(db, txid, coins, 6));
+    CDBBatch expected(db.GetDB());
+    expected.Erase(CoinKey(txid, 1));
+    BOOST_CHECK_EQUAL(db.GetLastBatchSize(), expected.SizeEstimate());
+
+    // Disconnecting a block restores the spent output, also after the
+    // transaction was spent entirely.
+    CCoins spent = coins;
+    for (unsigned int i = 0; i < spent.vout.size(); i++)
+        spent.Spend(i);
+    {
+        CCoinsViewCacheTest child(&parent);
+        *child.ModifyCoins(txid) = spent;
+        BOOST_CHECK(child.Flush());
+    }
+    BOOST_CHECK(parent.Flush());
+    BOOST_CHECK(HasRecordsFor(db, txid, spent, 6));
+    {
+        CCoinsViewCacheTest child(&parent);
+        {
+            // As ApplyTxInUndo does
+            CCoinsModifier mod = child.ModifyCoins(txid);
+            BOOST_CHECK(mod->IsPruned());
+            mod->fCoinBase = coins.fCoinBase;
+            mod->nHeight = coins.nHeight;
+            mod->nVersion = coins.nVersion;
+            mod->vout.resize(3);
+            mod->vout[2] = coins.vout[2];
+        }
+        child.SelfTest();
+        BOOST_CHECK(child.Flush());
+    }
+    parent.SelfTest();
+    BOOST_CHECK(parent.Flush());
+    CCoins restored = spent;
+    restored.vout.resize(3);
+    restored.vout[2] = coins.vout[2];
+    restored.Cleanup();
+    BOOST_CHECK(HasRecordsFor(db, txid, restored, 6));
+    CCoins stored;
+    BOOST_CHECK(db.GetCoins(txid, stored));
+    BOOST_CHECK(stored == restored);
+    BOOST_CHECK_EQUAL(stored.nHeight, 100);
+
+    // Re-creating a coinbase in the child over the outputs the parent loaded
+    // replaces them all, including the header.
+    BOOST_CHECK(parent.AccessCoins(cbtxid));
+    CCoins coinbase2 = MakeTestCoins(3, 250, true);
+    {
+        CCoinsViewCacheTest child(&parent);
+        *child.ModifyNewCoins(cbtxid, true) = coinbase2;
+        child.SelfTest();
+        BOOST_CHECK(child.Flush());
+    }
+    parent.SelfTest();
+    BOOST_CHECK(parent.Flush());
+    BOOST_CHECK(HasRecordsFor(db, cbtxid, coinbase2, 6));
+    BOOST_CHECK(db.GetCoins(cbtxid, stored));
+    BOOST_CHECK(stored == coinbase2);
+    BOOST_CHECK_EQUAL(stored.nHeight, 250);
+}
+
+BOOST_FIXTURE_TEST_CASE(coins_cache_prefetch, TestingSetup)
+{
+    CCoinsViewDBTest db;
+    std::map<uint256, CCoins> stored;
+    {
+        CCoinsViewCache cache(&db);
+        for (int i = 0; i < 50; i++) {
+            uint256 txid = GetRandHash();
+            stored[txid] = MakeTestCoins(1 + i % 3, i, false);
+            *cache.ModifyNewCoins(txid, false) = stored[txid];
+        }
+        BOOST_CHECK(cache.Flush());
+    }
+
+    CCoinsViewCacheTest cache(&db);
+    std::vector<uint256> txids;
+    for (std::map<uint256, CCoins>::const_iterator it = stored.begin(); it != stored.end(); ++it) {
+        txids.push_back(it->first);
+        txids.push_back(it->first);
+    }
+    std::vector<uint256> missing;
+    for (int i = 0; i < 10; i++) {
+        missing.push_back(GetRandHash());
+        txids.push_back(missing.back());
+    }
+    // One entry is cached (and modified) already and must be left alone.
+    BOOST_CHECK(cache.ModifyCoins(txids[0])->Spend(0));
+
+    BOOST_CHECK_EQUAL(cache.Prefetch(txids, 4), stored.size() - 1);
+    cache.SelfTest();
+    for (std::map<uint256, CCoins>::const_iterator it = stored.begin(); it != stored.end(); ++it) {
+        BOOST_CHECK(cache.HaveCoinsInCache(it->first));
+        if (it->first != txids[0])
+            BOOST_CHECK(*cache.AccessCoins(it->first) == it->second);
+    }
+    BOOST_CHECK(!cache.AccessCoins(txids[0])->IsAvailable(0));
+    BOOST_FOREACH(const uint256 &txid, missing)
+        BOOST_CHECK(!cache.HaveCoinsInCache(txid));
+    BOOST_CHECK_EQUAL(cache.Prefetch(txids, 4), 0);
+
+    // Prefetched entries flush like fetched ones.
+    BOOST_CHECK(cache.ModifyCoins(txids[2])->Spend(0));
+    BOOST_CHECK(cache.Flush());
+    for (int i = 0; i < 4; i += 2) {
+        CCoins expected = stored[txids[i]], coins;
+        expected.Spend(0);
+        BOOST_CHECK(db.GetCoins(txids[i], coins) ? coins == expected : expected.IsPruned());
+    }
+}
+
+BOOST_FIXTURE_TEST_CASE(coins_db_upgrade, TestingSetup)
+{
+    CCoinsViewDBTest db;
+    uint256 hashBlock = GetRandHash();
+    std::map<uint256, CCoins> legacy;
+    for (int i = 0; i < 10; i++) {
+        CCoins coins = MakeTestCoins(1 + i, i, i == 0);
+        if (i > 1)
+            coins.Spend(1);
+        uint256 txid = GetRandHash();
+        legacy[txid] = coins;
+        BOOST_CHECK(db.GetDB().Write(std::make_pair('c', txid), coins));
+    }
+    BOOST_CHECK(db.GetDB().Write('B', hashBlock));
+
+    BOOST_CHECK(db.Upgrade());
+    BOOST_CHECK(db.GetBestBlock() == hashBlock);
+    BOOST_CHECK(!db.GetDB().Exists('B'));
+    BOOST_CHECK(!db.GetDB().Exists('U'));
+    for (std::map<uint256, CCoins>::const_iterator it = legacy.begin(); it != legacy.end(); ++it) {
+        CCoins stored;
+        BOOST_CHECK(db.GetCoins(it->first, stored));
+        BOOST_CHECK(stored == it->second);
+        BOOST_CHECK(HasRecordsFor(db, it->first, it->second, 12));
+        BOOST_CHECK(!db.GetDB().Exists(std::make_pair('c', it->first)));
+    }
+    // Upgrading an already upgraded database is a no-op.
+    BOOST_CHECK(db.Upgrade());
+
+    // An interrupted upgrade has converted some records and moved the best
+    // block aside; the next run picks up the rest.
+    BOOST_CHECK(db.GetDB().Erase('H'));
+    BOOST_CHECK(db.GetDB().Write('U', hashBlock));
+    for (int i = 0; i < 10; i++) {
+        CCoins coins = MakeTestCoins(2 + i, 1000 + i, false);
+        uint256 txid = GetRandHash();
+        legacy[txid] = coins;
+        BOOST_CHECK(db.GetDB().Write(std::make_pair('c', txid), coins));
+    }
+    BOOST_CHECK(db.GetBestBlock().IsNull());
+    BOOST_CHECK(db.Upgrade());
+    BOOST_CHECK(db.GetBestBlock() == hashBlock);
+    BOOST_CHECK(!db.GetDB().Exists('U'));
+    for (std::map<uint256, CCoins>::const_iterator it = legacy.begin(); it != legacy.end(); ++it) {
+        CCoins stored;
+        BOOST_CHECK(db.GetCoins(it->first, stored));
+        BOOST_CHECK(stored == it->second);
+        BOOST_CHECK(!db.GetDB().Exists(std::make_pair('c', it->first)));
+    }
+
+    // An older version syncing over the converted database is detected.
+    BOOST_CHECK(db.GetDB().Write('B', hashBlock));
+    BOOST_CHECK(!db.Upgrade());
+    BOOST_CHECK(db.GetDB().Erase('B'));
+    BOOST_CHECK(db.GetDB().Write(std::make_pair('c', GetRandHash()), MakeTestCoins(1, 1, false)));
+    BOOST_CHECK(!db.Upgrade());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
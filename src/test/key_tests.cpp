@@ -188,4 +188,43 @@ BOOST_AUTO_TEST_CASE(key_test1)
     BOOST_CHECK(detsigc == ParseHex("2052d8a32079c11e79db95af63bb9600c5b04f21a9ca33dc129c2bfa8ac9dc1cd561d8ae5e0f6c1a16bde3719c64c2fd70e404b6428ab9a69566962e8771b5944d"));
 }
 
+BOOST_AUTO_TEST_CASE(key_parsed_verify)
+{
+    CBitcoinSecret bsecret1, bsecret1C;
+    BOOST_CHECK(bsecret1.SetString (strSecret1));
+    BOOST_CHECK(bsecret1C.SetString(strSecret1C));
+    CKey key1  = bsecret1.GetKey();
+    CKey key1C = bsecret1C.GetKey();
+
+    uint256 hashMsg = Hash(strSecret1.begin(), strSecret1.end());
+    uint256 hashOther = Hash(strSecret2.begin(), strSecret2.end());
+
+    for (int i = 0; i < 2; i++) {
+        const CKey& key = i == 0 ? key1 : key1C;
+        CPubKey pubkey = key.GetPubKey();
+        std::vector<unsigned char> vchSig;
+        BOOST_CHECK(key.Sign(hashMsg, vchSig));
+
+        CParsedPubKey parsed;
+        BOOST_CHECK(pubkey.Parse(parsed));
+        BOOST_CHECK(CPubKey::VerifyParsed(parsed, hashMsg, vchSig));
+        BOOST_CHECK(!CPubKey::VerifyParsed(parsed, hashOther, vchSig));
+        BOOST_CHECK(!CPubKey::VerifyParsed(parsed, hashMsg, std::vector<unsigned char>()));
+
+        // A compressed and an uncompressed serialization parse to the same key
+        CPubKey pubkeyFull = pubkey;
+        BOOST_CHECK(pubkeyFull.Decompress());
+        CParsedPubKey parsedFull;
+        BOOST_CHECK(pubkeyFull.Parse(parsedFull));
+        BOOST_CHECK(memcmp(parsed.data, parsedFull.data, sizeof(parsed.data)) == 0);
+    }
+
+    // Keys that are not fully valid do not parse
+    CParsedPubKey parsed;
+    BOOST_CHECK(!CPubKey().Parse(parsed));
+    std::vector<unsigned char> vchBad(33, 0);
+    vchBad[0] = 0x02;
+    BOOST_CHECK(!CPubKey(vchBad).Parse(parsed));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -164,4 +164,72 @@ BOOST_AUTO_TEST_CASE(cnode_simple_test)
     BOOST_CHECK(pnode2->fFeeler == false);
 }
 
+BOOST_AUTO_TEST_CASE(cnode_receive_in_place)
+{
+    CAddress addr = CAddress(CService("127.0.0.1", 7777), NODE_NETWORK);
+    CNode node(INVALID_SOCKET, addr, "", true);
+
+    // A large message followed by a small one, as they would arrive on the wire
+    std::vector<char> vPayload(300000);
+    for (unsigned int i = 0; i < vPayload.size(); i++)
+        vPayload[i] = insecure_rand();
+    CDataStream ssWire(SER_NETWORK, PROTOCOL_VERSION);
+    ssWire << CMessageHeader(Params().MessageStart(), "block", vPayload.size());
+    ssWire.write(&vPayload[0], vPayload.size());
+    ssWire << CMessageHeader(Params().MessageStart(), "ping", 8) << (uint64_t)42;
+    std::string strWire = ssWire.str();
+
+    // Feed it in socket-sized pieces, the way ThreadSocketHandler does
+    LOCK(node.cs_vRecvMsg);
+    size_t nPos = 0;
+    int nInPlace = 0;
+    while (nPos < strWire.size()) {
+        unsigned int nChunk = std::min<size_t>(0x10000, strWire.size() - nPos);
+        char* pchInPlace = node.GetInPlaceRecvBuffer(nChunk);
+        if (pchInPlace) {
+            memcpy(pchInPlace, &strWire[nPos], nChunk);
+            node.ReceivedMsgBytesInPlace(nChunk);
+            nInPlace++;
+        } else {
+            BOOST_CHECK(node.ReceiveMsgBytes(&strWire[nPos], nChunk));
+        }
+        nPos += nChunk;
+    }
+    BOOST_CHECK(nInPlace > 0);
+
+    BOOST_CHECK_EQUAL(node.vRecvMsg.size(), 2U);
+    const CNetMessage& msgBlock = node.vRecvMsg.front();
+    BOOST_CHECK(msgBlock.complete());
+    BOOST_CHECK_EQUAL(msgBlock.hdr.GetCommand(), "block");
+    BOOST_CHECK_EQUAL(msgBlock.vRecv.size(), vPayload.size());
+    BOOST_CHECK(std::equal(vPayload.begin(), vPayload.end(), msgBlock.vRecv.begin()));
+    const CNetMessage& msgPing = node.vRecvMsg.back();
+    BOOST_CHECK(msgPing.complete());
+    BOOST_CHECK_EQUAL(msgPing.hdr.GetCommand(), "ping");
+    BOOST_CHECK_EQUAL(msgPing.vRecv.size(), 8U);
+
+    // Nothing is received in place between messages
+    BOOST_CHECK(node.GetInPlaceRecvBuffer(1) == NULL);
+}
+
+BOOST_AUTO_TEST_CASE(socketevents_mode)
+{
+    SocketEventsMode mode;
+    BOOST_CHECK(ParseSocketEventsMode("select", mode));
+    BOOST_CHECK(mode == SOCKETEVENTS_SELECT);
+    BOOST_CHECK_EQUAL(GetSocketEventsModeName(mode), "select");
+#ifdef HAVE_SYS_EPOLL_H
+    BOOST_CHECK(ParseSocketEventsMode("epoll", mode));
+    BOOST_CHECK(mode == SOCKETEVENTS_EPOLL);
+    BOOST_CHECK_EQUAL(GetSocketEventsModeName(mode), "epoll");
+#else
+    BOOST_CHECK(!ParseSocketEventsMode("epoll", mode));
+#endif
+    BOOST_CHECK(!ParseSocketEventsMode("kqueue", mode));
+    BOOST_CHECK(!ParseSocketEventsMode("", mode));
+
+    // The default must be usable in this build
+    BOOST_CHECK(ParseSocketEventsMode(DEFAULT_SOCKETEVENTS, mode));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
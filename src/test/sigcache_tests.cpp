@@ -0,0 +1,111 @@
+// Copyright (c) 2016 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "key.h"
+#include "primitives/transaction.h"
+#include "random.h"
+#include "script/sigcache.h"
+#include "uint256.h"
+#include "test/test_bitcoin.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(sigcache_tests, BasicTestingSetup)
+
+BOOST_AUTO_TEST_CASE(sigcache_get_set_erase)
+{
+    CSignatureCache cache(1 << 20);
+    CSignatureCacheStats stats;
+    cache.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nEntries, 0U);
+    BOOST_CHECK(stats.nCapacity > 0);
+    BOOST_CHECK(stats.nBytes <= (1 << 20));
+
+    std::vector<uint256> vEntries;
+    for (int i = 0; i < 100; i++) {
+        vEntries.push_back(GetRandHash());
+        BOOST_CHECK(!cache.Get(vEntries.back(), false));
+        cache.Set(vEntries.back());
+    }
+    cache.Set(vEntries[0]);
+    for (int i = 0; i < 100; i++)
+        BOOST_CHECK(cache.Get(vEntries[i], false));
+
+    // Erasing lookups hit once
+    BOOST_CHECK(cache.Get(vEntries[0], true));
+    BOOST_CHECK(!cache.Get(vEntries[0], false));
+
+    cache.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nEntries, 99U);
+    BOOST_CHECK_EQUAL(stats.nInserts, 100U);
+    BOOST_CHECK_EQUAL(stats.nHits, 101U);
+    BOOST_CHECK_EQUAL(stats.nMisses, 101U);
+    BOOST_CHECK_EQUAL(stats.nEvictions, 0U);
+
+    CSignatureCache disabled(0);
+    disabled.Set(vEntries[1]);
+    BOOST_CHECK(!disabled.Get(vEntries[1], false));
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_eviction)
+{
+    // 16 buckets per shard
+    CSignatureCache cache(CSignatureCache::SHARDS * CSignatureCache::WAYS * 16 * (sizeof(uint256) + 1));
+    CSignatureCacheStats stats;
+    cache.GetStats(stats);
+    BOOST_CHECK_EQUAL(stats.nCapacity, CSignatureCache::SHARDS * CSignatureCache::WAYS * 16U);
+
+    std::vector<uint256> vEntries;
+    for (size_t i = 0; i < stats.nCapacity * 10; i++) {
+        vEntries.push_back(GetRandHash());
+        cache.Set(vEntries.back());
+    }
+
+    cache.GetStats(stats);
+    BOOST_CHECK(stats.nEntries <= stats.nCapacity);
+    BOOST_CHECK(stats.nEntries > stats.nCapacity * 9 / 10);
+    BOOST_CHECK_EQUAL(stats.nInserts, stats.nCapacity * 10);
+    BOOST_CHECK_EQUAL(stats.nEvictions, stats.nInserts - stats.nEntries);
+
+    // The oldest entries make room for the newest
+    size_t nRecent = 0, nOld = 0;
+    for (size_t i = 0; i < stats.nCapacity / 4; i++) {
+        nRecent += cache.Get(vEntries[vEntries.size() - 1 - i], false);
+        nOld += cache.Get(vEntries[i], false);
+    }
+    BOOST_CHECK(nRecent > stats.nCapacity / 4 * 95 / 100);
+    BOOST_CHECK(nOld < stats.nCapacity / 4 * 5 / 100);
+}
+
+BOOST_AUTO_TEST_CASE(sigcache_checker)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    uint256 hash = GetRandHash();
+    std::vector<unsigned char> vchSig;
+    BOOST_CHECK(key.Sign(hash, vchSig));
+
+    CTransaction tx;
+    PrecomputedTransactionData txdata(tx);
+    CachingTransactionSignatureChecker checkStore(&tx, 0, 0, true, txdata);
+    CachingTransactionSignatureChecker checkNoStore(&tx, 0, 0, false, txdata);
+
+    CSignatureCacheStats before, after;
+    GetSignatureCacheStats(before);
+    BOOST_CHECK(checkStore.VerifySignature(vchSig, key.GetPubKey(), hash));
+    BOOST_CHECK(checkStore.VerifySignature(vchSig, key.GetPubKey(), hash));
+    BOOST_CHECK(!checkStore.VerifySignature(vchSig, key.GetPubKey(), GetRandHash()));
+    // Block validation drops the entries it uses
+    BOOST_CHECK(checkNoStore.VerifySignature(vchSig, key.GetPubKey(), hash));
+    BOOST_CHECK(checkNoStore.VerifySignature(vchSig, key.GetPubKey(), hash));
+    GetSignatureCacheStats(after);
+
+    BOOST_CHECK_EQUAL(after.nInserts - before.nInserts, 1U);
+    BOOST_CHECK_EQUAL(after.nHits - before.nHits, 2U);
+    BOOST_CHECK_EQUAL(after.nMisses - before.nMisses, 3U);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
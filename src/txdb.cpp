@@ -7,41 +7,187 @@
 
 #include "chainparams.h"
 #include "hash.h"
+#include "init.h"
 #include "pow.h"
+#include "ui_interface.h"
 #include "uint256.h"
 
+#include <algorithm>
 #include <stdint.h>
 
 #include <boost/thread.hpp>
 
 using namespace std;
 
-static const char DB_COINS = 'c';
+static const char DB_COIN = 'C';
+static const char DB_COINS = 'c'; // legacy per-transaction records, see CCoinsViewDB::Upgrade()
 static const char DB_BLOCK_FILES = 'f';
 static const char DB_TXINDEX = 't';
 static const char DB_BLOCK_INDEX = 'b';
 
-static const char DB_BEST_BLOCK = 'B';
+static const char DB_BEST_BLOCK = 'B'; // legacy, only written by the per-transaction format
+static const char DB_HEAD_BLOCK = 'H';
+static const char DB_UPGRADE_BLOCK = 'U';
 static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
 
+//! Size of the batches written while upgrading the chainstate (bytes)
+static const size_t nUpgradeBatchSize = 16 << 20;
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true) 
+namespace {
+
+//! Serialized size of a transaction header key: (DB_COIN, txid)
+static const unsigned int nCoinsHeaderKeySize = 1 + 32;
+
+/**
+ * Database key of a single unspent output: (DB_COIN, txid, VARINT(n)).
+ *
+ * The transaction header key (DB_COIN, txid) is a prefix of it, so a
+ * transaction's header is immediately followed by its outputs on disk.
+ */
+struct CoinEntry
+{
+    char key;
+    uint256 hash;
+    uint32_t n;
+
+    CoinEntry() : key(0), n(0) {}
+    CoinEntry(const uint256 &hashIn, uint32_t nIn) : key(DB_COIN), hash(hashIn), n(nIn) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(key);
+        READWRITE(hash);
+        READWRITE(VARINT(n));
+    }
+};
+
+/**
+ * Database value of a transaction header, stored under (DB_COIN, txid) for as
+ * long as the transaction has at least one unspent output record.
+ *
+ * Serialized format:
+ * - VARINT(nHeight * 2 + fCoinBase)
+ * - VARINT(nVersion)
+ *
+ * Output records only hold the CTxOut (via CTxOutCompressor).
+ */
+struct CoinsHeader
+{
+    int nHeight;
+    bool fCoinBase;
+    int nTxVersion;
+
+    CoinsHeader() : nHeight(0), fCoinBase(false), nTxVersion(0) {}
+    CoinsHeader(const CCoins &coins) : nHeight(coins.nHeight), fCoinBase(coins.fCoinBase), nTxVersion(coins.nVersion) {}
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        unsigned int nCode = nHeight * 2 + (fCoinBase ? 1 : 0);
+        READWRITE(VARINT(nCode));
+        if (ser_action.ForRead()) {
+            nHeight = nCode / 2;
+            fCoinBase = nCode & 1;
+        }
+        READWRITE(VARINT(nTxVersion));
+    }
+};
+
+/** Queue the header and every unspent output of coins for writing. */
+void WriteCoins(CDBBatch &batch, const uint256 &txid, const CCoins &coins)
+{
+    batch.Write(make_pair(DB_COIN, txid), CoinsHeader(coins));
+    for (unsigned int i = 0; i < coins.vout.size(); i++) {
+        if (!coins.vout[i].IsNull())
+            batch.Write(CoinEntry(txid, i), CTxOutCompressor(REF(coins.vout[i])));
+    }
+}
+
+/**
+ * Gather the transaction whose header pcursor points at into coins, leaving
+ * pcursor at the first record past its outputs. Returns false if pcursor
+ * does not point at a transaction header.
+ */
+bool ReadCoinsAt(CDBIterator *pcursor, uint256 &txid, CCoins &coins, unsigned int &nValueSize)
+{
+    std::pair<char, uint256> key;
+    if (!pcursor->Valid() || pcursor->GetKeySize() != nCoinsHeaderKeySize || !pcursor->GetKey(key) || key.first != DB_COIN)
+        return false;
+    CoinsHeader header;
+    if (!pcursor->GetValue(header))
+        return error("%s: unable to read header of %s", __func__, key.second.ToString());
+    txid = key.second;
+    coins.Clear();
+    coins.fCoinBase = header.fCoinBase;
+    coins.nHeight = header.nHeight;
+    coins.nVersion = header.nTxVersion;
+    nValueSize = pcursor->GetValueSize();
+    pcursor->Next();
+    CoinEntry entry;
+    while (pcursor->Valid() && pcursor->GetKeySize() > nCoinsHeaderKeySize && pcursor->GetKey(entry) && entry.key == DB_COIN && entry.hash == txid) {
+        if (entry.n >= coins.vout.size())
+            coins.vout.resize(entry.n + 1);
+        CTxOutCompressor out(coins.vout[entry.n]);
+        if (!pcursor->GetValue(out))
+            return error("%s: unable to read output %s:%u", __func__, txid.ToString(), entry.n);
+        nValueSize += pcursor->GetValueSize();
+        pcursor->Next();
+    }
+    return true;
+}
+
+/** Queue the header and all output records of txid for erasure. */
+void EraseCoins(CDBWrapper &db, CDBBatch &batch, const uint256 &txid)
+{
+    boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator(true));
+    pcursor->Seek(make_pair(DB_COIN, txid));
+    std::pair<char, uint256> key;
+    while (pcursor->Valid() && pcursor->GetKey(key) && key.first == DB_COIN && key.second == txid) {
+        if (pcursor->GetKeySize() == nCoinsHeaderKeySize) {
+            batch.Erase(key);
+        } else {
+            CoinEntry entry;
+            if (pcursor->GetKey(entry))
+                batch.Erase(entry);
+        }
+        pcursor->Next();
+    }
+}
+
+} // anon namespace
+
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe, true), nLastBatchSize(0)
 {
 }
 
 bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) const {
-    return db.Read(make_pair(DB_COINS, txid), coins);
+    // Rule out missing transactions with a (bloom filtered) point lookup of
+    // the header before scanning its outputs.
+    if (!db.Exists(make_pair(DB_COIN, txid)))
+        return false;
+    boost::scoped_ptr<CDBIterator> pcursor(const_cast<CDBWrapper*>(&db)->NewIterator(true));
+    pcursor->Seek(make_pair(DB_COIN, txid));
+    uint256 hash;
+    unsigned int nValueSize;
+    CCoins tmp;
+    if (!ReadCoinsAt(pcursor.get(), hash, tmp, nValueSize) || hash != txid)
+        return false;
+    coins.swap(tmp);
+    return true;
 }
 
 bool CCoinsViewDB::HaveCoins(const uint256 &txid) const {
-    return db.Exists(make_pair(DB_COINS, txid));
+    return db.Exists(make_pair(DB_COIN, txid));
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const {
     uint256 hashBestChain;
-    if (!db.Read(DB_BEST_BLOCK, hashBestChain))
+    if (!db.Read(DB_HEAD_BLOCK, hashBestChain))
         return uint256();
     return hashBestChain;
 }
@@ -50,12 +196,42 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
     CDBBatch batch(db);
     size_t count = 0;
     size_t changed = 0;
+    size_t written = 0;
+    size_t erased = 0;
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            if (it->second.coins.IsPruned())
-                batch.Erase(make_pair(DB_COINS, it->first));
-            else
-                batch.Write(make_pair(DB_COINS, it->first), it->second.coins);
+            const CCoinsCacheEntry &entry = it->second;
+            const CCoins &coins = entry.coins;
+            // Which outputs of this transaction are on disk: none if the entry
+            // is fresh, otherwise the ones the cache found when loading it.
+            bool fBaseKnown = !(entry.flags & CCoinsCacheEntry::FRESH) && entry.baseAvail.IsKnown();
+            bool fOnDisk = fBaseKnown && !entry.baseAvail.IsEmpty();
+            if (!entry.HasBaseAvail() && db.Exists(make_pair(DB_COIN, it->first))) {
+                // The entry replaced coins without loading them (a re-created
+                // duplicate coinbase), so rewrite the transaction wholesale.
+                EraseCoins(db, batch, it->first);
+                fOnDisk = true;
+            }
+            // Only touch the outputs whose unspentness differs from what is
+            // on disk; an output's data never changes while it exists.
+            unsigned int nOutputs = std::max((unsigned int)coins.vout.size(), fBaseKnown ? entry.baseAvail.GetBound() : 0);
+            for (unsigned int i = 0; i < nOutputs; i++) {
+                bool fWasAvail = fBaseKnown && entry.baseAvail.IsAvailable(i);
+                bool fAvail = coins.IsAvailable(i);
+                if (fAvail && !fWasAvail) {
+                    batch.Write(CoinEntry(it->first, i), CTxOutCompressor(REF(coins.vout[i])));
+                    written++;
+                } else if (fWasAvail && !fAvail) {
+                    batch.Erase(CoinEntry(it->first, i));
+                    erased++;
+                }
+            }
+            if (coins.IsPruned()) {
+                if (fOnDisk)
+                    batch.Erase(make_pair(DB_COIN, it->first));
+            } else if (!fOnDisk || !fBaseKnown) {
+                batch.Write(make_pair(DB_COIN, it->first), CoinsHeader(coins));
+            }
             changed++;
         }
         count++;
@@ -63,12 +239,95 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock) {
         mapCoins.erase(itOld);
     }
     if (!hashBlock.IsNull())
-        batch.Write(DB_BEST_BLOCK, hashBlock);
+        batch.Write(DB_HEAD_BLOCK, hashBlock);
 
-    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
+    nLastBatchSize = batch.SizeEstimate();
+    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database: %u outputs written, %u erased, %.2f MiB...\n",
+        (unsigned int)changed, (unsigned int)count, (unsigned int)written, (unsigned int)erased, nLastBatchSize * (1.0 / 1048576.0));
     return db.WriteBatch(batch);
 }
 
+bool CCoinsViewDB::Upgrade() {
+    // A database in the per-transaction format stores its best block under
+    // DB_BEST_BLOCK. Conversion moves it to DB_UPGRADE_BLOCK in its first
+    // batch and to DB_HEAD_BLOCK in its last one, so an interrupted upgrade
+    // resumes on next startup, and older versions (which only know
+    // DB_BEST_BLOCK) see an empty chainstate rather than a corrupt one.
+    uint256 hashBlock;
+    bool fHead = db.Exists(DB_HEAD_BLOCK);
+    bool fResume = db.Read(DB_UPGRADE_BLOCK, hashBlock);
+    bool fLegacy = db.Exists(DB_BEST_BLOCK);
+    boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+    pcursor->Seek(make_pair(DB_COINS, uint256()));
+    std::pair<char, uint256> key;
+    bool fLegacyCoins = pcursor->Valid() && pcursor->GetKey(key) && key.first == DB_COINS;
+    if (fHead || (fResume && fLegacy)) {
+        if (fLegacy || fLegacyCoins || fResume) {
+            // An older version wrote to this database after it was converted.
+            return error("%s: the chainstate database mixes storage formats; restart with -reindex-chainstate", __func__);
+        }
+        return true;
+    }
+    if (!fResume) {
+        if (!fLegacy) {
+            // Nothing connected yet; the first flush writes the new format.
+            return true;
+        }
+        db.Read(DB_BEST_BLOCK, hashBlock);
+    }
+
+    int64_t count = 0;
+    LogPrintf("Upgrading utxo-set database to per-output records...\n");
+    LogPrintf("[0%%]...");
+    uiInterface.ShowProgress(_("Upgrading UTXO database"), 0);
+    int reportDone = 0;
+    CDBBatch batch(db);
+    batch.Write(DB_UPGRADE_BLOCK, hashBlock);
+    batch.Erase(DB_BEST_BLOCK);
+    while (pcursor->Valid()) {
+        if (ShutdownRequested()) {
+            break;
+        }
+        if (!pcursor->GetKey(key) || key.first != DB_COINS) {
+            break;
+        }
+        if (count++ % 256 == 0) {
+            uint32_t high = 0x100 * *key.second.begin() + *(key.second.begin() + 1);
+            int percentageDone = (int)(high * 100.0 / 65536.0 + 0.5);
+            uiInterface.ShowProgress(_("Upgrading UTXO database"), percentageDone);
+            if (reportDone < percentageDone / 10) {
+                // report max. every 10% step
+                LogPrintf("[%d%%]...", percentageDone);
+                reportDone = percentageDone / 10;
+            }
+        }
+        CCoins coins;
+        if (!pcursor->GetValue(coins)) {
+            return error("%s: cannot parse CCoins record", __func__);
+        }
+        if (!coins.IsPruned())
+            WriteCoins(batch, key.second, coins);
+        batch.Erase(key);
+        // Each batch converts whole transactions, so an interrupted upgrade
+        // simply resumes from the remaining legacy records on next startup.
+        if (batch.SizeEstimate() > nUpgradeBatchSize) {
+            if (!db.WriteBatch(batch))
+                return false;
+            batch.Clear();
+        }
+        pcursor->Next();
+    }
+    if (!ShutdownRequested()) {
+        batch.Write(DB_HEAD_BLOCK, hashBlock);
+        batch.Erase(DB_UPGRADE_BLOCK);
+    }
+    if (!db.WriteBatch(batch))
+        return false;
+    uiInterface.ShowProgress("", 100);
+    LogPrintf("[%s].\n", ShutdownRequested() ? "CANCELLED" : "DONE");
+    return !ShutdownRequested();
+}
+
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
 }
 
@@ -98,17 +357,17 @@ CCoinsViewCursor *CCoinsViewDB::Cursor() const
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
-    i->pcursor->Seek(DB_COINS);
-    // Cache key of first record
-    i->pcursor->GetKey(i->keyTmp);
+    i->pcursor->Seek(DB_COIN);
+    // Gather the outputs of the first transaction
+    i->Next();
     return i;
 }
 
 bool CCoinsViewDBCursor::GetKey(uint256 &key) const
 {
     // Return cached key
-    if (keyTmp.first == DB_COINS) {
-        key = keyTmp.second;
+    if (fValid) {
+        key = keyTmp;
         return true;
     }
     return false;
@@ -116,24 +375,28 @@ bool CCoinsViewDBCursor::GetKey(uint256 &key) const
 
 bool CCoinsViewDBCursor::GetValue(CCoins &coins) const
 {
-    return pcursor->GetValue(coins);
+    if (fValid) {
+        coins = coinsTmp;
+        return true;
+    }
+    return false;
 }
 
 unsigned int CCoinsViewDBCursor::GetValueSize() const
 {
-    return pcursor->GetValueSize();
+    return nValueSizeTmp;
 }
 
 bool CCoinsViewDBCursor::Valid() const
 {
-    return keyTmp.first == DB_COINS;
+    return fValid;
 }
 
 void CCoinsViewDBCursor::Next()
 {
-    pcursor->Next();
-    if (!pcursor->Valid() || !pcursor->GetKey(keyTmp))
-        keyTmp.first = 0; // Invalidate cached key after last record so that Valid() and GetKey() return false
+    // Outputs of one transaction are adjacent in the database, as they share
+    // the (DB_COIN, txid) key prefix.
+    fValid = ReadCoinsAt(pcursor.get(), keyTmp, coinsTmp, nValueSizeTmp);
 }
 
 bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockFileInfo*> >& fileInfo, int nLastFile, const std::vector<const CBlockIndex*>& blockinfo) {
@@ -61,11 +61,21 @@ struct CDiskTxPos : public CDiskBlockPos
     }
 };
 
-/** CCoinsView backed by the coin database (chainstate/) */
+/**
+ * CCoinsView backed by the coin database (chainstate/)
+ *
+ * Every unspent output is stored as its own record keyed by its outpoint, so
+ * spending one output of a large transaction only erases that one record.
+ * The metadata shared by the outputs (height, coinbase flag, version) lives
+ * in a header record keyed by the txid, which exists as long as any of the
+ * outputs does. Older versions cannot read this format; see Upgrade().
+ */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
     CDBWrapper db;
+    //! Estimated size of the last batch written by BatchWrite (bytes)
+    size_t nLastBatchSize;
 public:
     CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
 
@@ -74,6 +84,11 @@ public:
     uint256 GetBestBlock() const;
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock);
     CCoinsViewCursor *Cursor() const;
+
+    //! Convert an older per-transaction chainstate in place. Returns false on failure or interruption.
+    bool Upgrade();
+
+    size_t GetLastBatchSize() const { return nLastBatchSize; }
 };
 
 /** Specialization of CCoinsViewCursor to iterate over a CCoinsViewDB */
@@ -91,9 +106,13 @@ public:
 
 private:
     CCoinsViewDBCursor(CDBIterator* pcursorIn, const uint256 &hashBlockIn):
-        CCoinsViewCursor(hashBlockIn), pcursor(pcursorIn) {}
+        CCoinsViewCursor(hashBlockIn), pcursor(pcursorIn), nValueSizeTmp(0), fValid(false) {}
     boost::scoped_ptr<CDBIterator> pcursor;
-    std::pair<char, uint256> keyTmp;
+    //! The transaction at the cursor, gathered from its per-output records
+    uint256 keyTmp;
+    CCoins coinsTmp;
+    unsigned int nValueSizeTmp;
+    bool fValid;
 
     friend class CCoinsViewDB;
 };